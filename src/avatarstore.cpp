@@ -0,0 +1,116 @@
+#include "avatarstore.h"
+#include "settings.h"
+#include "log.h"
+
+#include <QDir>
+#include <QSaveFile>
+#include <QFileInfo>
+#include <QCryptographicHash>
+
+Avatar::Avatar(const QString &fileName)
+	: file_(fileName)
+	, data_(nullptr)
+	, size_(0)
+{
+	if (!file_.open(QIODevice::ReadOnly))
+		return;
+
+	size_ = file_.size();
+	if (size_ > 0)
+		data_ = file_.map(0, size_);
+}
+
+Avatar::~Avatar()
+{
+	if (data_)
+		file_.unmap(data_);
+}
+
+AvatarStore::AvatarStore()
+	: path_(Settings::dataPath() + QDir::separator() + "avatars")
+	, capacity_(GetSettings()->params()["avatarCacheSize"].toInt())
+{
+	QDir dir(path_);
+	if (!dir.exists())
+		dir.mkpath(".");
+}
+
+QString AvatarStore::put(const QByteArray &image)
+{
+	if (image.isEmpty())
+		return QString();
+
+	QString hash = QString::fromLatin1(QCryptographicHash::hash(image, QCryptographicHash::Sha256).toHex());
+	if (contains(hash))
+		return hash;
+
+	QString name = fileName(hash);
+	QDir().mkpath(QFileInfo(name).path());
+
+	// Written under a temporary name and renamed, readers never see a partial file
+	QSaveFile file(name);
+	if (!file.open(QIODevice::WriteOnly) || file.write(image) != image.size() || !file.commit())
+	{
+		LOGE("Can't write avatar: " << name.toStdString());
+		return QString();
+	}
+
+	return hash;
+}
+
+AvatarPtr AvatarStore::get(const QString &hash)
+{
+	if (!isHash(hash))
+		return nullptr;
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	QHash<QString, LruList::iterator>::iterator it = mapped_.find(hash);
+	if (it != mapped_.end())
+	{
+		lru_.splice(lru_.begin(), lru_, it.value());
+		return it.value()->second;
+	}
+
+	AvatarPtr avatar = QSharedPointer<Avatar>::create(fileName(hash));
+	if (!avatar->isValid())
+		return nullptr;
+
+	if (capacity_ <= 0)
+		return avatar;
+
+	// Dropping a mapping from the cache does not unmap it while a reader holds it
+	lru_.emplace_front(hash, avatar);
+	mapped_.insert(hash, lru_.begin());
+	while (mapped_.size() > capacity_)
+	{
+		mapped_.remove(lru_.back().first);
+		lru_.pop_back();
+	}
+
+	return avatar;
+}
+
+bool AvatarStore::contains(const QString &hash) const
+{
+	return isHash(hash) && QFile::exists(fileName(hash));
+}
+
+bool AvatarStore::isHash(const QString &hash)
+{
+	if (hash.size() != 64)
+		return false;
+
+	for (QChar c : hash)
+	{
+		if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f')))
+			return false;
+	}
+
+	return true;
+}
+
+QString AvatarStore::fileName(const QString &hash) const
+{
+	// Two level fan-out keeps directories small
+	return path_ + QDir::separator() + hash.left(2) + QDir::separator() + hash;
+}
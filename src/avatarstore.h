@@ -0,0 +1,71 @@
+#ifndef AVATARSTORE_H
+#define AVATARSTORE_H
+
+#include <QString>
+#include <QByteArray>
+#include <QFile>
+#include <QHash>
+#include <QSharedPointer>
+
+#include <list>
+#include <mutex>
+
+// Read only memory mapping of a stored avatar
+class Avatar
+{
+private:
+	QFile file_;
+	uchar *data_;
+	qint64 size_;
+
+public:
+	explicit Avatar(const QString &fileName);
+	~Avatar();
+
+public:
+	bool isValid() const { return data_ != nullptr; }
+	// Valid while this object lives
+	QByteArray data() const { return QByteArray::fromRawData(reinterpret_cast<const char *>(data_), size_); }
+	qint64 size() const { return size_; }
+};
+
+using AvatarPtr = QSharedPointer<Avatar>;
+
+// Content-addressed avatar files under <data>/avatars, named by SHA-256 of the image.
+// Identical images are stored once. Recently used files stay mapped.
+class AvatarStore
+{
+	friend class QSharedPointer<AvatarStore>;
+
+private:
+	using LruList = std::list<std::pair<QString, AvatarPtr>>;
+
+	QString path_;
+	std::mutex mutex_;
+	LruList lru_; // Most recently used first
+	QHash<QString, LruList::iterator> mapped_;
+	int capacity_;
+
+private:
+	AvatarStore();
+
+public:
+	QString put(const QByteArray &image);
+	AvatarPtr get(const QString &hash);
+	bool contains(const QString &hash) const;
+
+	static bool isHash(const QString &hash);
+
+private:
+	QString fileName(const QString &hash) const;
+};
+
+using AvatarStorePtr = QSharedPointer<AvatarStore>;
+
+inline AvatarStorePtr GetAvatarStore()
+{
+	static AvatarStorePtr store = QSharedPointer<AvatarStore>::create();
+	return store;
+}
+
+#endif // AVATARSTORE_H
@@ -2,23 +2,35 @@
 #include "log.h"
 #include "database.h"
 #include "dispatcher.h"
+#include "settings.h"
+#include "metrics.h"
 
 #include <QJsonDocument>
 #include <QJsonObject>
 #include <QJsonArray>
 
-#include <algorithm>
+Client::Client(int id, const QString &login, QWebSocket *socket, Protocol protocol, Compression compression)
+	: id_(id)
+	, login_(login)
+	, socket_(socket, &QObject::deleteLater)
+	, protocol_(protocol)
+	, compression_(compression)
+{
+}
 
-Client::Client(int id, const QString &login, QWebSocket *socket)
+Client::Client(int id, const QString &login, const WebSocketPtr &socket, Protocol protocol, Compression compression)
 	: id_(id)
 	, login_(login)
 	, socket_(socket)
+	, protocol_(protocol)
+	, compression_(compression)
 {
 }
 
 ClientService::ClientService()
 	: active_(false)
 	, thread_(nullptr)
+	, pollInterval_(0)
 {
 }
 
@@ -27,14 +39,15 @@ ClientService::~ClientService()
 	stop();
 }
 
-void ClientService::sendMessage(const ClientPtr& client, const QString& text)
+void ClientService::sendMessage(const ClientPtr& client, const QByteArray& data)
 {
-	client->socket()->sendTextMessage(text);
+	GetDispatcher()->outbound().send(client->socket().get(), data, client->protocol(), Outbound::Kind::Push);
 }
 
 void ClientService::start()
 {
 	active_ = true;
+	pollInterval_ = GetSettings()->params()["historyPollInterval"].toInt();
 	connect(this, &ClientService::messageReady, this, &ClientService::sendMessage);
 	thread_ = QThread::create([this]() { run(); });
 	thread_->start();
@@ -42,132 +55,223 @@ void ClientService::start()
 
 void ClientService::stop()
 {
-	active_ = false;
-	thread_->wait();
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		active_ = false;
+	}
+
+	condition_.notify_all();
+	if (thread_)
+		thread_->wait();
+}
+
+void ClientService::add(int id, const QString &login, QWebSocket *socket, Protocol protocol, Compression compression)
+{
+	// Reuse the socket pointer of a repeated auth, a socket must have a single owner
+	ClientPtr client = find(socket);
+	if (client != nullptr)
+		add(QSharedPointer<Client>::create(id, login, client->socket(), protocol, compression));
+	else
+		add(QSharedPointer<Client>::create(id, login, socket, protocol, compression));
+}
+
+void ClientService::add(const ClientPtr &client)
+{
+	int previousId = 0, previousCount = 0, count = 0;
+	{
+		std::lock_guard<std::mutex> lock(clientsMutex_);
+		ClientPtr previous = clientsBySocket_.take(client->socket().get());
+		if (previous != nullptr)
+		{
+			clientsById_.remove(previous->id(), previous);
+			previousId = previous->id();
+			previousCount = clientsById_.count(previousId);
+		}
+
+		clientsBySocket_.insert(client->socket().get(), client);
+		clientsById_.insert(client->id(), client);
+		count = clientsById_.count(client->id());
+	}
+
+	if (previousId != 0 && previousId != client->id())
+		emit presenceChanged(previousId, previousCount);
+	emit presenceChanged(client->id(), count);
 }
 
 ClientPtr ClientService::find(int id) const
 {
-	ClientList::const_iterator it = std::find_if(clients_.begin(), clients_.end(),
-							 [id](const ClientPtr &client) {
-		return client->id() == id;
-	});
+	std::lock_guard<std::mutex> lock(clientsMutex_);
+	return clientsById_.value(id);
+}
+
+ClientPtr ClientService::find(const QWebSocket *socket) const
+{
+	std::lock_guard<std::mutex> lock(clientsMutex_);
+	return clientsBySocket_.value(socket);
+}
 
-	if (it != clients_.end())
-		return *it;
-	return nullptr;
+ClientList ClientService::findAll(int id) const
+{
+	std::lock_guard<std::mutex> lock(clientsMutex_);
+	return clientsById_.values(id);
+}
+
+ClientSocketMap ClientService::snapshot() const
+{
+	std::lock_guard<std::mutex> lock(clientsMutex_);
+	return clientsBySocket_;
+}
+
+int ClientService::size() const
+{
+	std::lock_guard<std::mutex> lock(clientsMutex_);
+	return clientsBySocket_.size();
 }
 
 void ClientService::remove(int id)
 {
-	clients_.removeIf([id](const ClientPtr &client) {
-		return client->id() == id;
-	});
+	{
+		std::lock_guard<std::mutex> lock(clientsMutex_);
+		for (const ClientPtr &client : clientsById_.values(id))
+			clientsBySocket_.remove(client->socket().get());
+		clientsById_.remove(id);
+	}
+
+	emit presenceChanged(id, 0);
 }
 
 void ClientService::remove(const WebSocketPtr& socket)
 {
-	clients_.removeIf([socket](const ClientPtr &client) {
-		return client->socket() == socket;
-	});
+	remove(socket.get());
 }
 
 void ClientService::remove(const QWebSocket* socket)
 {
-	clients_.removeIf([socket](const ClientPtr &client) {
-		return client->socket().get() == socket;
-	});
+	int id = 0, count = 0;
+	{
+		std::lock_guard<std::mutex> lock(clientsMutex_);
+		ClientPtr client = clientsBySocket_.take(socket);
+		if (client == nullptr)
+			return;
+
+		clientsById_.remove(client->id(), client);
+		id = client->id();
+		count = clientsById_.count(id);
+	}
+
+	emit presenceChanged(id, count);
 }
 
-void ClientService::run()
+void ClientService::notify(int id, HistoryState state)
 {
-	while (active_)
 	{
-		for (const ClientPtr &client : clients_)
-		{
-			checkNewHistory(client);
-			checkModifiedHistory(client);
-			checkRemovedHistory(client);
-		}
-
-		QThread::msleep(100);
+		std::lock_guard<std::mutex> lock(mutex_);
+		pending_[id] |= 1 << static_cast<int>(state);
 	}
+
+	condition_.notify_one();
 }
 
-void ClientService::checkNewHistory(const ClientPtr& client)
+void ClientService::run()
 {
-	QVariantMap options;
-	options["all"] = false;
-	options["state"] = static_cast<int>(HistoryState::Regular);
-	options["cid"] = client->id();
+	const int allStates = (1 << static_cast<int>(HistoryState::Regular)) |
+						  (1 << static_cast<int>(HistoryState::Modified)) |
+						  (1 << static_cast<int>(HistoryState::Removed));
 
-	VariantMapList historyList;
-	if (GetDatabase()->queryHistory(historyList, options))
+	while (active_)
 	{
-		QJsonObject root;
-		QJsonArray historyArray;
-		for (const QVariantMap &data : historyList)
+		// Sleep until a history write is reported, the safety net poll is due or the service stops
+		QHash<int, int> pending;
+		bool poll = false;
 		{
-			QJsonObject history = QJsonObject::fromVariantMap(data);
-			historyArray.push_back(history);
+			std::unique_lock<std::mutex> lock(mutex_);
+			auto ready = [this]() { return !active_ || !pending_.isEmpty(); };
+
+			if (pollInterval_ > 0)
+				poll = !condition_.wait_for(lock, std::chrono::milliseconds(pollInterval_), ready);
+			else
+				condition_.wait(lock, ready);
+
+			pending.swap(pending_);
 		}
 
-		root["history"] = historyArray;
-		root["action"] = static_cast<int>(Dispatcher::Action::NewHistory);
-		emit messageReady(client, QJsonDocument(root).toJson(QJsonDocument::Compact));
-		GetDatabase()->setReadHistory(client->id());
-		LOG("Update history, contact: " << client->login().toStdString());
-	}
-}
+		if (!active_)
+			break;
 
-void ClientService::checkModifiedHistory(const ClientPtr& client)
-{
-	QVariantMap options;
-	options["all"] = false;
-	options["state"] = static_cast<int>(HistoryState::Modified);
-	options["cid"] = client->id();
+		static Histogram &iteration = GetMetrics()->histogram("clientService.pushLoop");
+		ScopedTimer timer(iteration);
 
-	VariantMapList historyList;
-	if (GetDatabase()->queryHistory(historyList, options))
-	{
-		QJsonObject root;
-		QJsonArray historyArray;
-		for (const QVariantMap &data : historyList)
+		if (poll)
 		{
-			QJsonObject history = QJsonObject::fromVariantMap(data);
-			historyArray.push_back(history);
+			ClientSocketMap clients = snapshot();
+			Shards &shards = GetDispatcher()->shards();
+			for (const ClientPtr &client : clients)
+			{
+				// The delivery cursor is shared, only the shard pushing for the contact polls it
+				if (shards.isOwner(client->id()))
+					pending[client->id()] = allStates;
+			}
 		}
 
-		root["history"] = historyArray;
-		root["action"] = static_cast<int>(Dispatcher::Action::ModifyHistory);
-		emit messageReady(client, QJsonDocument(root).toJson(QJsonDocument::Compact));
-		GetDatabase()->setReadHistory(client->id());
-		LOG("Modify history, contact: " << client->login().toStdString());
+		for (QHash<int, int>::const_iterator it = pending.cbegin(); it != pending.cend(); ++it)
+		{
+			ClientList clients = findAll(it.key());
+			if (!clients.isEmpty())
+				checkHistory(clients);
+		}
 	}
 }
 
-void ClientService::checkRemovedHistory(const ClientPtr& client)
+void ClientService::checkHistory(const ClientList &clients)
 {
+	// Changes after the delivery cursor, one frame per state and page. A long absence
+	// is sent as several bounded pages instead of one frame with everything.
+	const ClientPtr &client = clients.first();
+	int limit = qMax(GetSettings()->params()["historyPageLimit"].toInt(), 1);
 	QVariantMap options;
 	options["all"] = false;
-	options["state"] = static_cast<int>(HistoryState::Removed);
 	options["cid"] = client->id();
+	options["limit"] = limit;
 
+	static const Dispatcher::Action actions[] = {
+		Dispatcher::Action::NewHistory,		// HistoryState::Regular
+		Dispatcher::Action::ModifyHistory,	// HistoryState::Modified
+		Dispatcher::Action::RemoveHistory	// HistoryState::Removed
+	};
+
+	int changes = 0;
 	VariantMapList historyList;
-	if (GetDatabase()->queryHistory(historyList, options))
+	while (active_ && GetDatabase()->queryHistory(historyList, options))
 	{
-		QJsonObject root;
-		QJsonArray historyArray;
+		QJsonArray historyArrays[3];
+		qint64 seq = 0;
 		for (const QVariantMap &data : historyList)
 		{
-			QJsonObject history = QJsonObject::fromVariantMap(data);
-			historyArray.push_back(history);
+			int state = qBound(0, data["state"].toInt(), 2);
+			historyArrays[state].push_back(QJsonObject::fromVariantMap(data));
+			seq = qMax(seq, data["seq"].toLongLong());
+		}
+
+		for (int state = 0; state < 3; ++state)
+		{
+			if (historyArrays[state].isEmpty())
+				continue;
+
+			QJsonObject root;
+			root["history"] = historyArrays[state];
+			root["action"] = static_cast<int>(actions[state]);
+			for (const ClientPtr &device : clients)
+				emit messageReady(device, encodeMessage(root, device->protocol(), device->compression()));
+			GetDispatcher()->shards().deliver(client->id(), root, true);
 		}
 
-		root["history"] = historyArray;
-		root["action"] = static_cast<int>(Dispatcher::Action::RemoveHistory);
-		emit messageReady(client, QJsonDocument(root).toJson(QJsonDocument::Compact));
-		GetDatabase()->setReadHistory(client->id());
-		LOG("Remove history, contact: " << client->login().toStdString());
+		// Only what was sent, a write that landed after the query is pushed next time
+		GetDatabase()->setDeliveredSeq(client->id(), seq);
+		changes += historyList.size();
+		if (historyList.size() < limit)
+			break;
 	}
+
+	if (changes > 0)
+		LOG("Update history, contact: " << client->login().toStdString() << ", changes: " << changes);
 }
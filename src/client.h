@@ -7,11 +7,22 @@
 #include <QList>
 #include <QSharedPointer>
 #include <QThread>
+#include <QHash>
+#include <QMultiHash>
+
+#include "protocol.h"
+
+#include <mutex>
+#include <condition_variable>
 
 class Client;
 using WebSocketPtr = QSharedPointer<QWebSocket>;
 using ClientPtr = QSharedPointer<Client>;
 using ClientList = QList<ClientPtr>;
+using ClientIdMap = QMultiHash<int, ClientPtr>;
+using ClientSocketMap = QHash<const QWebSocket*, ClientPtr>;
+
+enum class HistoryState;
 
 class Client
 {
@@ -19,14 +30,21 @@ private:
 	int id_;
 	QString login_;
 	WebSocketPtr socket_;
+	Protocol protocol_;
+	Compression compression_;
 
 public:
-	Client(int id, const QString &login, QWebSocket *socket);
+	Client(int id, const QString &login, QWebSocket *socket, Protocol protocol = Protocol::Json,
+		   Compression compression = Compression::None);
+	Client(int id, const QString &login, const WebSocketPtr &socket, Protocol protocol = Protocol::Json,
+		   Compression compression = Compression::None);
 
 public:
 	int id() const { return id_; }
 	QString login() const { return login_; }
 	WebSocketPtr socket() const { return socket_; }
+	Protocol protocol() const { return protocol_; }
+	Compression compression() const { return compression_; }
 };
 
 class ClientService : public QObject
@@ -35,35 +53,49 @@ class ClientService : public QObject
 
 private:
 	std::atomic_bool active_;
-	ClientList clients_;
 	QThread *thread_;
 
+	// Registry, written under clientsMutex_. Readers copy the implicitly shared
+	// hashes, so iterating a snapshot never blocks connects and disconnects.
+	mutable std::mutex clientsMutex_;
+	ClientIdMap clientsById_;
+	ClientSocketMap clientsBySocket_;
+
+	int pollInterval_;
+	std::mutex mutex_;
+	std::condition_variable condition_;
+	QHash<int, int> pending_; // Contact id -> mask of changed history states
+
 public:
 	ClientService();
 	~ClientService();
 
 signals:
-	void messageReady(const ClientPtr &client, const QString &text);
+	void messageReady(const ClientPtr &client, const QByteArray &data);
+	void presenceChanged(int id, int count); // Devices of the contact connected here
 
 private slots:
-	void sendMessage(const ClientPtr &client, const QString &text);
+	void sendMessage(const ClientPtr &client, const QByteArray &data);
 
 public:
 	void start();
 	void stop();
-	void add(int id, const QString &login, QWebSocket *socket) {
-		clients_.push_back(QSharedPointer<Client>::create(id, login, socket)); }
-	void add(const ClientPtr &client) { clients_.push_back(client); }
+	void add(int id, const QString &login, QWebSocket *socket, Protocol protocol = Protocol::Json,
+			 Compression compression = Compression::None);
+	void add(const ClientPtr &client);
 	ClientPtr find(int id) const;
+	ClientPtr find(const QWebSocket *socket) const;
+	ClientList findAll(int id) const;
+	ClientSocketMap snapshot() const;
+	int size() const;
 	void remove(int id);
 	void remove(const WebSocketPtr &socket);
 	void remove(const QWebSocket *socket);
+	void notify(int id, HistoryState state);
 
 private:
 	void run();
-	void checkNewHistory(const ClientPtr &client);
-	void checkModifiedHistory(const ClientPtr &client);
-	void checkRemovedHistory(const ClientPtr &client);
+	void checkHistory(const ClientList &clients);
 };
 
 #endif // CLIENT_H
@@ -56,6 +56,11 @@ int64_t timestamp_micro()
 	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
 }
 
+int64_t steady_micro()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 bool isQtCreatorParentProc()
 {
 #ifndef WIN32
@@ -7,6 +7,7 @@ std::string currentTime();
 std::string currentTimeMs();
 int64_t timestamp();
 int64_t timestamp_micro();
+int64_t steady_micro();
 bool isQtCreatorParentProc();
 
 #endif // Theme_H
@@ -0,0 +1,122 @@
+#include "contactcache.h"
+#include "settings.h"
+
+void ContactRecord::toJson(QJsonObject &contact) const
+{
+	contact["id"] = id;
+	contact["name"] = name;
+	contact["login"] = login;
+	contact["avatar"] = avatar;
+	contact["phone"] = phone;
+}
+
+ContactCache::ContactCache()
+	: capacity_(GetSettings()->params()["contactCacheSize"].toInt())
+	, hits_(GetMetrics()->counter("contactCache.hits"))
+	, misses_(GetMetrics()->counter("contactCache.misses"))
+	, evictions_(GetMetrics()->counter("contactCache.evictions"))
+{
+}
+
+void ContactCache::setCapacity(int capacity)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	capacity_ = capacity;
+	while (byId_.size() > qMax(capacity_, 0))
+	{
+		erase(byId_.find(lru_.back()->id));
+		evictions_.add();
+	}
+}
+
+ContactRecordPtr ContactCache::find(int id)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	QHash<int, LruList::iterator>::iterator it = byId_.find(id);
+	if (it == byId_.end())
+	{
+		misses_.add();
+		return nullptr;
+	}
+
+	hits_.add();
+	return touch(it);
+}
+
+ContactRecordPtr ContactCache::find(const QString &login)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	QHash<QString, int>::const_iterator loginIt = byLogin_.constFind(login);
+	if (loginIt == byLogin_.constEnd())
+	{
+		misses_.add();
+		return nullptr;
+	}
+
+	hits_.add();
+	return touch(byId_.find(loginIt.value()));
+}
+
+void ContactCache::put(const ContactRecordPtr &record)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (capacity_ <= 0)
+		return;
+
+	QHash<int, LruList::iterator>::iterator it = byId_.find(record->id);
+	if (it != byId_.end())
+		erase(it);
+
+	lru_.push_front(record);
+	byId_.insert(record->id, lru_.begin());
+	byLogin_.insert(record->login, record->id);
+
+	while (byId_.size() > capacity_)
+	{
+		erase(byId_.find(lru_.back()->id));
+		evictions_.add();
+	}
+}
+
+void ContactCache::invalidate(int id)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	QHash<int, LruList::iterator>::iterator it = byId_.find(id);
+	if (it != byId_.end())
+		erase(it);
+}
+
+void ContactCache::invalidate(const QString &login)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	QHash<QString, int>::const_iterator loginIt = byLogin_.constFind(login);
+	if (loginIt != byLogin_.constEnd())
+		erase(byId_.find(loginIt.value()));
+}
+
+void ContactCache::clear()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	lru_.clear();
+	byId_.clear();
+	byLogin_.clear();
+}
+
+int ContactCache::size() const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	return byId_.size();
+}
+
+ContactRecordPtr ContactCache::touch(QHash<int, LruList::iterator>::iterator it)
+{
+	lru_.splice(lru_.begin(), lru_, it.value());
+	return *it.value();
+}
+
+void ContactCache::erase(QHash<int, LruList::iterator>::iterator it)
+{
+	byLogin_.remove((*it.value())->login);
+	lru_.erase(it.value());
+	byId_.erase(it);
+}
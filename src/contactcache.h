@@ -0,0 +1,77 @@
+#ifndef CONTACTCACHE_H
+#define CONTACTCACHE_H
+
+#include <QString>
+#include <QHash>
+#include <QSharedPointer>
+#include <QJsonObject>
+
+#include <list>
+#include <mutex>
+
+#include "metrics.h"
+
+// Contacts table row
+struct ContactRecord
+{
+	int id = 0;
+	QString name;
+	QString login;
+	QString password;
+	QString avatar; // Avatar store hash
+	QString phone;
+
+	void toJson(QJsonObject &contact) const;
+};
+
+using ContactRecordPtr = QSharedPointer<const ContactRecord>;
+
+// Bounded LRU cache of contacts by id and by login, shared by all threads
+class ContactCache
+{
+	friend class QSharedPointer<ContactCache>;
+
+private:
+	using LruList = std::list<ContactRecordPtr>;
+
+	mutable std::mutex mutex_;
+	LruList lru_; // Most recently used first
+	QHash<int, LruList::iterator> byId_;
+	QHash<QString, int> byLogin_;
+	int capacity_;
+
+	Counter &hits_;
+	Counter &misses_;
+	Counter &evictions_;
+
+private:
+	ContactCache();
+
+public:
+	void setCapacity(int capacity);
+	ContactRecordPtr find(int id);
+	ContactRecordPtr find(const QString &login);
+	void put(const ContactRecordPtr &record);
+	void invalidate(int id);
+	void invalidate(const QString &login);
+	void clear();
+
+	int size() const;
+	uint64_t hits() const { return hits_.value(); }
+	uint64_t misses() const { return misses_.value(); }
+	uint64_t evictions() const { return evictions_.value(); }
+
+private:
+	ContactRecordPtr touch(QHash<int, LruList::iterator>::iterator it);
+	void erase(QHash<int, LruList::iterator>::iterator it);
+};
+
+using ContactCachePtr = QSharedPointer<ContactCache>;
+
+inline ContactCachePtr GetContactCache()
+{
+	static ContactCachePtr cache = QSharedPointer<ContactCache>::create();
+	return cache;
+}
+
+#endif // CONTACTCACHE_H
@@ -2,14 +2,38 @@
 #include "dbnames.h"
 #include "settings.h"
 #include "log.h"
+#include "common.h"
+#include "metrics.h"
+#include "avatarstore.h"
 
 #include <QVariant>
 #include <QDebug>
 #include <QCoreApplication>
 #include <QDir>
 #include <QJsonArray>
+#include <QStringList>
+#include <QHash>
+#include <QRegularExpression>
+
+#include <atomic>
+#include <limits>
+
+namespace
+{
+
+// History columns plus "readBy": whether the recipient's read cursor for the sender covers the row
+QString historyColumns(const QString &table = kHistoryName)
+{
+	return table + ".*, EXISTS (SELECT 1 FROM " + QString(kReadCursorsName) + " r WHERE r.reader = " + table +
+			".rid AND r.peer = " + table + ".cid AND r.hid >= " + table + ".id) AS readBy";
+}
+
+}
 
 Database::Database()
+	: statementHits_(0)
+	, statementMisses_(0)
+	, prepareTime_(0)
 {
 }
 
@@ -20,24 +44,117 @@ Database::~Database()
 
 bool Database::open()
 {
-	// Create database path
-	QDir dbDir = Settings::dataPath() + QDir::separator() + "db";
-	if (!dbDir.exists())
-		dbDir.mkpath(".");
+	if (db_.isOpen())
+		return true;
+
+	// Database file from the settings, or the default one in the data directory
+	QString dbFile = GetSettings()->params()["dbFile"].toString();
+	if (dbFile.isEmpty())
+	{
+		QDir dbDir = Settings::dataPath() + QDir::separator() + "db";
+		if (!dbDir.exists())
+			dbDir.mkpath(".");
+
+		dbFile = dbDir.absolutePath() + QDir::separator() + kDbName;
+	}
 
 	// Open or create database
-	QString dbFile = dbDir.absolutePath() + QDir::separator() + kDbName;
-	db_ = QSqlDatabase::addDatabase("QSQLITE");
+	static std::atomic_int connections(0);
+	db_ = QSqlDatabase::addDatabase("QSQLITE", QString(kDbHostName) + "-" + QString::number(++connections));
 	db_.setHostName(kDbHostName);
 	db_.setDatabaseName(dbFile);
 
-	if (db_.open())
+	if (!db_.open())
+		return false;
+
+	if (!setupConnection())
+		return false;
+
+	return migrate();
+}
+
+bool Database::setupConnection()
+{
+	QSqlQuery query(db_);
+	int cacheSize = GetSettings()->params()["dbCacheSize"].toInt();
+
+	if (!execute(query, "PRAGMA journal_mode = WAL") ||
+		!execute(query, "PRAGMA synchronous = NORMAL") ||
+		!execute(query, "PRAGMA temp_store = MEMORY") ||
+		!execute(query, "PRAGMA busy_timeout = 5000") ||
+		!execute(query, "PRAGMA cache_size = -" + QString::number(cacheSize)))
+		return false;
+
+	return true;
+}
+
+const QList<Database::Migration> &Database::migrations()
+{
+	// Append new steps to the end, never change the version of a released step
+	static const QList<Migration> list = {
+		{ 1, "create tables", &Database::createTables },
+		{ 2, "create history, contacts and links indexes", &Database::createIndexes },
+		{ 3, "create history conversation indexes", &Database::createConversationIndexes },
+		{ 4, "create history full-text index", &Database::createHistoryFts },
+		{ 5, "move contact images to the avatar store", &Database::moveAvatars },
+		{ 6, "add history change sequence", &Database::createHistorySeq },
+		{ 7, "replace history read flags with cursors", &Database::createCursors },
+		{ 8, "take history sequence from a counter", &Database::createSeqCounter }
+	};
+
+	return list;
+}
+
+bool Database::migrate()
+{
+	QSqlQuery query(db_);
+
+	// Take the write lock first, so concurrent openers agree on the schema version
+	if (!execute(query, "BEGIN IMMEDIATE"))
+		return false;
+
+	if (!execute(query, "PRAGMA user_version") || !query.next())
 	{
-		if (db_.tables().empty())
-			return createTables();
+		execute(query, "ROLLBACK");
+		return false;
 	}
-	else
+
+	int version = query.value(0).toInt();
+	int current = version;
+	query.finish();
+
+	for (const Migration &migration : migrations())
+	{
+		if (migration.version <= current)
+			continue;
+
+		LOG("Database migration " << migration.version << ": " << migration.description);
+		if (!(this->*migration.apply)())
+		{
+			LOGE("Database migration " << migration.version << " failed!");
+			execute(query, "ROLLBACK");
+			return false;
+		}
+
+		current = migration.version;
+	}
+
+	if (current != version && !execute(query, "PRAGMA user_version = " + QString::number(current)))
+	{
+		execute(query, "ROLLBACK");
 		return false;
+	}
+
+	return execute(query, "COMMIT");
+}
+
+bool Database::execute(QSqlQuery &query, const QString &sql)
+{
+	if (!query.exec(sql))
+	{
+		LOGE(query.lastError().text().toStdString());
+		return false;
+	}
 
 	return true;
 }
@@ -45,7 +162,7 @@ bool Database::open()
 bool Database::createTables()
 {
 	QSqlQuery query(db_);
-	if (!query.exec("CREATE TABLE " + QString(kHistoryName) + " ("
+	if (!query.exec("CREATE TABLE IF NOT EXISTS " + QString(kHistoryName) + " ("
 					"id INTEGER PRIMARY KEY AUTOINCREMENT, "
 					"hid INTEGER KEY NOT NULL, " // Id from cliemt history
 					"cid INTEGER KEY NOT NULL, " // Sender id
@@ -59,7 +176,7 @@ bool Database::createTables()
 		return false;
 	}
 
-	if (!query.exec("CREATE TABLE " + QString(kContactsName) + " ("
+	if (!query.exec("CREATE TABLE IF NOT EXISTS " + QString(kContactsName) + " ("
 					"id INTEGER PRIMARY KEY AUTOINCREMENT, "
 					"name VARCHAR(50) NOT NULL,"
 					"login VARCHAR(50) NOT NULL,"
@@ -73,7 +190,7 @@ bool Database::createTables()
 		return false;
 	}
 
-	if (!query.exec("CREATE TABLE " + QString(kLinkContactsName) + " ("
+	if (!query.exec("CREATE TABLE IF NOT EXISTS " + QString(kLinkContactsName) + " ("
 					"id INTEGER PRIMARY KEY AUTOINCREMENT, "
 					"cid INTEGER KEY NOT NULL, "
 					"rid INTEGER KEY NOT NULL, "
@@ -87,28 +204,488 @@ bool Database::createTables()
 	return true;
 }
 
+bool Database::createIndexes()
+{
+	QSqlQuery query(db_);
+
+	// Unread history lookups and the sender side of history queries
+	if (!execute(query, "CREATE INDEX IF NOT EXISTS history_rid_read_state ON " +
+				 QString(kHistoryName) + " (rid, read, state)") ||
+		!execute(query, "CREATE INDEX IF NOT EXISTS history_cid ON " + QString(kHistoryName) + " (cid)"))
+		return false;
+
+	// Registration was not atomic, old databases may hold duplicate logins. The first account
+	// keeps the login, the others are renamed to "<login>#<id>" so the index can be created.
+	QString contacts = kContactsName;
+	QString duplicates = "SELECT id, login FROM " + contacts + " WHERE id NOT IN "
+						 "(SELECT MIN(id) FROM " + contacts + " GROUP BY login)";
+	if (!execute(query, duplicates))
+		return false;
+
+	while (query.next())
+		LOGW("Duplicate login renamed: " << query.value("login").toString().toStdString() <<
+			 ", id: " << query.value("id").toInt());
+
+	if (!execute(query, "UPDATE " + contacts + " SET login = login || '#' || id WHERE id IN "
+				 "(SELECT id FROM (" + duplicates + "))") ||
+		!execute(query, "CREATE UNIQUE INDEX IF NOT EXISTS contacts_login ON " + contacts + " (login)"))
+		return false;
+
+	// Old databases may hold duplicate links, keep the first one
+	if (!execute(query, "DELETE FROM " + QString(kLinkContactsName) + " WHERE id NOT IN "
+				 "(SELECT MIN(id) FROM " + QString(kLinkContactsName) + " GROUP BY cid, rid)") ||
+		!execute(query, "CREATE UNIQUE INDEX IF NOT EXISTS linkcontacts_cid_rid ON " +
+				 QString(kLinkContactsName) + " (cid, rid)"))
+		return false;
+
+	return true;
+}
+
+bool Database::createConversationIndexes()
+{
+	QSqlQuery query(db_);
+
+	// Both directions of a conversation in id order, for history paging.
+	// The (cid, rid, id) index also serves every lookup history_cid did.
+	if (!execute(query, "CREATE INDEX IF NOT EXISTS history_cid_rid_id ON " +
+				 QString(kHistoryName) + " (cid, rid, id)") ||
+		!execute(query, "CREATE INDEX IF NOT EXISTS history_rid_cid_id ON " +
+				 QString(kHistoryName) + " (rid, cid, id)") ||
+		!execute(query, "DROP INDEX IF EXISTS history_cid"))
+		return false;
+
+	return true;
+}
+
+bool Database::createHistoryFts()
+{
+	QSqlQuery query(db_);
+	QString history = kHistoryName;
+	QString fts = kHistoryFtsName;
+
+	// External content table, the text is stored once in history
+	if (!execute(query, "CREATE VIRTUAL TABLE IF NOT EXISTS " + fts +
+				 " USING fts5(text, content='" + history + "', content_rowid='id')"))
+		return false;
+
+	// Keep the index in sync with every history write path
+	if (!execute(query, "CREATE TRIGGER IF NOT EXISTS " + fts + "_insert AFTER INSERT ON " + history +
+				 " BEGIN INSERT INTO " + fts + " (rowid, text) VALUES (new.id, new.text); END") ||
+		!execute(query, "CREATE TRIGGER IF NOT EXISTS " + fts + "_delete AFTER DELETE ON " + history +
+				 " BEGIN INSERT INTO " + fts + " (" + fts + ", rowid, text) VALUES ('delete', old.id, old.text); END") ||
+		!execute(query, "CREATE TRIGGER IF NOT EXISTS " + fts + "_update AFTER UPDATE OF text ON " + history +
+				 " BEGIN INSERT INTO " + fts + " (" + fts + ", rowid, text) VALUES ('delete', old.id, old.text);"
+				 " INSERT INTO " + fts + " (rowid, text) VALUES (new.id, new.text); END"))
+		return false;
+
+	// Index the existing history
+	return execute(query, "INSERT INTO " + fts + " (" + fts + ") VALUES ('rebuild')");
+}
+
+bool Database::moveAvatars()
+{
+	QSqlQuery query(db_);
+	if (!execute(query, "ALTER TABLE " + QString(kContactsName) + " ADD COLUMN avatar VARCHAR(64)"))
+		return false;
+
+	if (!execute(query, "SELECT id, image FROM " + QString(kContactsName) + " WHERE image IS NOT NULL AND image != ''"))
+		return false;
+
+	QSqlQuery update(db_);
+	update.prepare("UPDATE " + QString(kContactsName) + " SET avatar = :avatar, image = NULL WHERE id = :id");
+
+	// Files of a rolled back migration are harmless, they are addressed by content
+	while (query.next())
+	{
+		QByteArray image = QByteArray::fromBase64(query.value("image").toString().toLatin1());
+		QString hash = GetAvatarStore()->put(image);
+		if (hash.isEmpty())
+			return false;
+
+		update.bindValue(":avatar", hash);
+		update.bindValue(":id", query.value("id").toInt());
+		if (!update.exec())
+		{
+			queryError(update);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool Database::beginTransaction()
+{
+	if (!db_.transaction())
+	{
+		LOGE(db_.lastError().text().toStdString());
+		return false;
+	}
+
+	return true;
+}
+
+bool Database::commitTransaction()
+{
+	METRIC_DB("commitTransaction");
+	if (!db_.commit())
+	{
+		LOGE(db_.lastError().text().toStdString());
+		return false;
+	}
+
+	return true;
+}
+
+void Database::rollbackTransaction()
+{
+	db_.rollback();
+}
+
+bool Database::createHistorySeq()
+{
+	QSqlQuery query(db_);
+	QString history = kHistoryName;
+
+	// Every insert and every change of text or state moves a row to the end of the sequence,
+	// so "seq > cursor" is everything a client has not seen. Read flags don't count.
+	QString next = "(SELECT COALESCE(MAX(seq), 0) + 1 FROM " + history + ")";
+	if (!execute(query, "ALTER TABLE " + history + " ADD COLUMN seq INTEGER") ||
+		!execute(query, "UPDATE " + history + " SET seq = id") ||
+		!execute(query, "CREATE INDEX IF NOT EXISTS history_rid_seq ON " + history + " (rid, seq)") ||
+		!execute(query, "CREATE INDEX IF NOT EXISTS history_cid_seq ON " + history + " (cid, seq)") ||
+		!execute(query, "CREATE INDEX IF NOT EXISTS history_seq ON " + history + " (seq)"))
+		return false;
+
+	return execute(query, "CREATE TRIGGER IF NOT EXISTS history_seq_insert AFTER INSERT ON " + history +
+				   " BEGIN UPDATE " + history + " SET seq = " + next + " WHERE id = new.id; END") &&
+		   execute(query, "CREATE TRIGGER IF NOT EXISTS history_seq_update AFTER UPDATE OF text, state ON " + history +
+				   " BEGIN UPDATE " + history + " SET seq = " + next + " WHERE id = new.id; END");
+}
+
+bool Database::createCursors()
+{
+	QSqlQuery query(db_);
+	QString history = kHistoryName;
+	QString delivery = kDeliveryCursorsName;
+	QString read = kReadCursorsName;
+
+	if (!execute(query, "CREATE TABLE IF NOT EXISTS " + delivery + " ("
+				 "reader INTEGER PRIMARY KEY, " // Contact id
+				 "seq INTEGER NOT NULL)") || // History pushed up to this sequence
+		!execute(query, "CREATE TABLE IF NOT EXISTS " + read + " ("
+				 "reader INTEGER NOT NULL, " // Contact id
+				 "peer INTEGER NOT NULL, " // Conversation
+				 "hid INTEGER NOT NULL, " // Read up to this history id
+				 "PRIMARY KEY (reader, peer)) WITHOUT ROWID"))
+		return false;
+
+	// Delivered up to the first unread message, read up to the last read one
+	return execute(query, "INSERT OR REPLACE INTO " + delivery + " (reader, seq) SELECT rid,"
+				   " COALESCE(MIN(CASE WHEN read = 0 THEN seq END) - 1, MAX(seq)) FROM " + history + " GROUP BY rid") &&
+		   execute(query, "INSERT OR REPLACE INTO " + read + " (reader, peer, hid) SELECT rid, cid, MAX(id) FROM " +
+				   history + " WHERE read = 1 GROUP BY rid, cid");
+}
+
+bool Database::createSeqCounter()
+{
+	QSqlQuery query(db_);
+	QString history = kHistoryName;
+	QString counter = kHistorySeqName;
+
+	// MAX(seq) + 1 goes back when ClearHistory deletes the newest rows, and a client
+	// whose cursor is past the reused values would never see the new rows.
+	// The counter only grows. It starts above every sequence handed out so far.
+	if (!execute(query, "CREATE TABLE IF NOT EXISTS " + counter + " ("
+				 "id INTEGER PRIMARY KEY CHECK (id = 0), "
+				 "seq INTEGER NOT NULL)") ||
+		!execute(query, "INSERT OR REPLACE INTO " + counter + " (id, seq) SELECT 0, MAX("
+				 "(SELECT COALESCE(MAX(seq), 0) FROM " + history + "), "
+				 "(SELECT COALESCE(MAX(seq), 0) FROM " + QString(kDeliveryCursorsName) + "))") ||
+		!execute(query, "DROP TRIGGER IF EXISTS history_seq_insert") ||
+		!execute(query, "DROP TRIGGER IF EXISTS history_seq_update"))
+		return false;
+
+	QString next = " BEGIN UPDATE " + counter + " SET seq = seq + 1 WHERE id = 0;"
+				   " UPDATE " + history + " SET seq = (SELECT seq FROM " + counter + " WHERE id = 0) WHERE id = new.id; END";
+	return execute(query, "CREATE TRIGGER history_seq_insert AFTER INSERT ON " + history + next) &&
+		   execute(query, "CREATE TRIGGER history_seq_update AFTER UPDATE OF text, state ON " + history + next);
+}
+
 void Database::close()
 {
+	if (db_.isOpen())
+	{
+		// Let SQLite refresh planner statistics for the new indexes
+		QSqlQuery query(db_);
+		query.exec("PRAGMA optimize");
+	}
+
+	if (statementHits_ > 0 || statementMisses_ > 0)
+	{
+		StatementStats stats = statementStats();
+		LOG("Statement cache, hits: " << stats.hits << ", prepared: " << stats.misses <<
+			", prepare time: " << stats.prepareTime << " us, saved: " << stats.savedTime << " us");
+	}
+
+	statements_.clear();
+	failedStatement_ = QSqlQuery();
+	if (!db_.isValid())
+		return;
+
+	QString connection = db_.connectionName();
 	db_.close();
+	db_ = QSqlDatabase();
+	QSqlDatabase::removeDatabase(connection);
 }
 
-bool Database::appendHistory(const QJsonObject &object)
+QString Database::statementText(Statement id)
 {
+	switch (id)
+	{
+	case Statement::AppendHistory:
+		return "INSERT INTO " + QString(kHistoryName) + " (hid, cid, rid, text, read, state, ts)"
+				" VALUES (:hid, :cid, :rid, :text, :read, :state, :ts)";
+	case Statement::ModifyHistory:
+		return "UPDATE " + QString(kHistoryName) + " SET text = :text, state = :state, read = :read"
+				" WHERE hid = :hid AND cid = :cid AND rid = :rid";
+	case Statement::ModifyRemoveHistory:
+		return "UPDATE " + QString(kHistoryName) + " SET state = :state, read = :read"
+				" WHERE hid = :hid AND cid = :cid AND rid = :rid";
+	case Statement::RemoveHistory:
+		return "DELETE FROM " + QString(kHistoryName) + " WHERE hid = :hid AND cid = :cid AND rid = :rid";
+	case Statement::ClearHistory:
+		return "DELETE FROM " + QString(kHistoryName) + " WHERE cid = :cid OR rid = :cid";
+	case Statement::QueryAllHistory:
+		return "SELECT " + historyColumns() + " FROM " + QString(kHistoryName) + " WHERE (rid = :cid OR cid = :cid) AND state != :state";
+	case Statement::QueryHistoryRecord:
+		return "SELECT " + historyColumns() + " FROM " + QString(kHistoryName) + " WHERE id = :id";
+	case Statement::SetRelayed:
+		return "UPDATE " + QString(kHistoryName) + " SET read = :read WHERE id = :id";
+	case Statement::QueryPendingHistory:
+		// Changes after the reader's delivery cursor, except messages already relayed directly.
+		// Sound only because seq comes from the historyseq counter and never repeats.
+		return "SELECT " + historyColumns() + " FROM " + QString(kHistoryName) + " WHERE rid = :cid AND seq > "
+				"COALESCE((SELECT seq FROM " + QString(kDeliveryCursorsName) + " WHERE reader = :cid), 0)"
+				" AND (read = 0 OR state != :state) ORDER BY seq LIMIT :limit";
+	case Statement::QueryConversations:
+		// Loose index scan: one index seek per peer instead of reading every message
+		return "WITH RECURSIVE "
+				"sent(peer) AS (SELECT MIN(rid) FROM " + QString(kHistoryName) + " WHERE cid = :cid "
+				"UNION ALL SELECT (SELECT MIN(rid) FROM " + QString(kHistoryName) + " WHERE cid = :cid AND rid > peer) "
+				"FROM sent WHERE peer IS NOT NULL), "
+				"received(peer) AS (SELECT MIN(cid) FROM " + QString(kHistoryName) + " WHERE rid = :cid "
+				"UNION ALL SELECT (SELECT MIN(cid) FROM " + QString(kHistoryName) + " WHERE rid = :cid AND cid > peer) "
+				"FROM received WHERE peer IS NOT NULL) "
+				"SELECT peer FROM sent WHERE peer IS NOT NULL "
+				"UNION SELECT peer FROM received WHERE peer IS NOT NULL";
+	case Statement::QueryHistoryPageBefore:
+		return "SELECT * FROM ("
+				"SELECT * FROM (SELECT " + historyColumns() + " FROM " + QString(kHistoryName) + " WHERE cid = :cid AND rid = :rid"
+				" AND id < :before AND id > :after AND state != :state ORDER BY id DESC LIMIT :limit) "
+				"UNION ALL "
+				"SELECT * FROM (SELECT " + historyColumns() + " FROM " + QString(kHistoryName) + " WHERE cid = :rid AND rid = :cid"
+				" AND id < :before AND id > :after AND state != :state ORDER BY id DESC LIMIT :limit)"
+				") ORDER BY id DESC LIMIT :limit";
+	case Statement::QueryHistoryPageAfter:
+		return "SELECT * FROM ("
+				"SELECT * FROM (SELECT " + historyColumns() + " FROM " + QString(kHistoryName) + " WHERE cid = :cid AND rid = :rid"
+				" AND id < :before AND id > :after AND state != :state ORDER BY id ASC LIMIT :limit) "
+				"UNION ALL "
+				"SELECT * FROM (SELECT " + historyColumns() + " FROM " + QString(kHistoryName) + " WHERE cid = :rid AND rid = :cid"
+				" AND id < :before AND id > :after AND state != :state ORDER BY id ASC LIMIT :limit)"
+				") ORDER BY id ASC LIMIT :limit";
+	case Statement::SearchHistory:
+		// Driven from the requester's rows, each one checked against the match by rowid, so the
+		// cost follows the requester's history and not the matches of every user
+		return "SELECT " + historyColumns("h") + ", bm25(" + QString(kHistoryFtsName) + ") AS score FROM " + QString(kHistoryName) + " h"
+				" CROSS JOIN " + QString(kHistoryFtsName) + " ON " + QString(kHistoryFtsName) + ".rowid = h.id"
+				" WHERE (h.cid = :cid OR h.rid = :cid) AND h.state != :state AND " + QString(kHistoryFtsName) + " MATCH :text"
+				" ORDER BY score LIMIT :limit OFFSET :offset";
+	case Statement::SyncHistory:
+		// Two range scans on the sequence indexes, one per direction
+		return "SELECT * FROM ("
+				"SELECT * FROM (SELECT " + historyColumns() + " FROM " + QString(kHistoryName) + " WHERE rid = :cid AND seq > :since"
+				" ORDER BY seq LIMIT :limit) "
+				"UNION ALL "
+				"SELECT * FROM (SELECT " + historyColumns() + " FROM " + QString(kHistoryName) + " WHERE cid = :cid AND rid != :cid"
+				" AND seq > :since ORDER BY seq LIMIT :limit)"
+				") ORDER BY seq LIMIT :limit";
+	case Statement::SyncConversation:
+		return "SELECT * FROM ("
+				"SELECT * FROM (SELECT " + historyColumns() + " FROM " + QString(kHistoryName) + " WHERE rid = :cid AND seq > :since"
+				" AND cid = :rid ORDER BY seq LIMIT :limit) "
+				"UNION ALL "
+				"SELECT * FROM (SELECT " + historyColumns() + " FROM " + QString(kHistoryName) + " WHERE cid = :cid AND seq > :since"
+				" AND rid = :rid AND rid != :cid ORDER BY seq LIMIT :limit)"
+				") ORDER BY seq LIMIT :limit";
+	case Statement::QueryHistorySeq:
+		return "SELECT seq FROM " + QString(kHistorySeqName) + " WHERE id = 0";
+	case Statement::SetDeliveredSeq:
+		return "INSERT INTO " + QString(kDeliveryCursorsName) + " (reader, seq) VALUES (:reader, :seq)"
+				" ON CONFLICT (reader) DO UPDATE SET seq = MAX(seq, excluded.seq)";
+	case Statement::SetReadCursor:
+		return "INSERT INTO " + QString(kReadCursorsName) + " (reader, peer, hid) VALUES (:reader, :peer, :hid)"
+				" ON CONFLICT (reader, peer) DO UPDATE SET hid = MAX(hid, excluded.hid)";
+	case Statement::QueryReadCursors:
+		return "SELECT peer, hid FROM " + QString(kReadCursorsName) + " WHERE reader = :reader";
+	case Statement::CountUnread:
+		return "SELECT COUNT(*) FROM " + QString(kHistoryName) + " WHERE cid = :peer AND rid = :reader"
+				" AND id > :hid AND state != :state";
+	case Statement::AppendContact:
+		return "INSERT INTO " + QString(kContactsName) + " (name, login, password, avatar, phone, ts)"
+				" VALUES (:name, :login, :password, :avatar, :phone, :ts)";
+	case Statement::ModifyContact:
+		return "UPDATE " + QString(kContactsName) + " SET name = :name, login = :login,"
+				" password = :password, avatar = :avatar, phone = :phone WHERE id = :id";
+	case Statement::RemoveContact:
+		return "DELETE FROM " + QString(kContactsName) + " WHERE id = :id";
+	case Statement::SearchContacts:
+		return "SELECT * FROM " + QString(kContactsName) + " WHERE login LIKE :pattern";
+	case Statement::QueryContactByLogin:
+		return "SELECT * FROM " + QString(kContactsName) + " WHERE login = :login";
+	case Statement::QueryContactById:
+		return "SELECT * FROM " + QString(kContactsName) + " WHERE id = :id";
+	case Statement::QueryLinkedContacts:
+		return "SELECT c.* FROM " + QString(kLinkContactsName) + " l JOIN " + QString(kContactsName) +
+				" c ON c.id = l.rid WHERE l.cid = :cid ORDER BY l.id";
+	case Statement::LinkExists:
+		return "SELECT rid FROM " + QString(kLinkContactsName) + " WHERE cid = :cid AND rid = :rid";
+	case Statement::LinkContact:
+		return "INSERT INTO " + QString(kLinkContactsName) + " (cid, rid, approved, ts)"
+				" VALUES (:cid, :rid, :approved, :ts)";
+	case Statement::UnlinkContact:
+		return "DELETE FROM " + QString(kLinkContactsName) + " WHERE cid = :cid AND rid = :rid";
+	case Statement::QueryLinks:
+		return "SELECT rid FROM " + QString(kLinkContactsName) + " WHERE cid = :cid";
+	}
+
+	return QString();
+}
+
+QSqlQuery &Database::statement(Statement id) const
+{
+	std::unordered_map<Statement, QSqlQuery>::iterator it = statements_.find(id);
+	if (it != statements_.end())
+	{
+		++statementHits_;
+		it->second.finish();
+		return it->second;
+	}
+
+	int64_t start = steady_micro();
 	QSqlQuery query(db_);
-	query.prepare("INSERT INTO " + QString(kHistoryName) + " (hid, cid, rid, text, read, state, ts)"
-														   " VALUES (:hid, :cid, :rid, :text, :read, :state, :ts)");
+	query.setForwardOnly(true);
+	bool prepared = query.prepare(statementText(id));
+	prepareTime_ += steady_micro() - start;
+	++statementMisses_;
+
+	// A transient failure, like a lock held by a migrating shard, is retried on the next use.
+	// The caller gets the failed query, its exec fails and is reported as usual.
+	if (!prepared)
+	{
+		LOGE(query.lastError().text().toStdString());
+		failedStatement_ = query;
+		return failedStatement_;
+	}
+
+	return statements_.emplace(id, query).first->second;
+}
+
+void Database::queryError(const QSqlQuery &query) const
+{
+	LOGE(query.lastError().text().toStdString());
+	static Counter &errors = GetMetrics()->counter("db.errors");
+	errors.add();
+	++Metrics::phases().errors;
+}
+
+Database::StatementStats Database::statementStats() const
+{
+	StatementStats stats;
+	stats.hits = statementHits_;
+	stats.misses = statementMisses_;
+	stats.prepareTime = prepareTime_;
+	stats.savedTime = stats.misses > 0 ? stats.prepareTime * stats.hits / stats.misses : 0;
+	return stats;
+}
+
+bool Database::appendHistory(const QJsonObject &object, bool read, QVariantMap *record)
+{
+	METRIC_DB("appendHistory");
+	QSqlQuery &query = statement(Statement::AppendHistory);
+	if (!insertHistory(query, object, read))
+		return false;
+
+	if (record == nullptr)
+		return true;
+
+	// The stored row as every other path sends it, with the server id and the seq set by the trigger
+	QSqlQuery &select = statement(Statement::QueryHistoryRecord);
+	select.bindValue(":id", query.lastInsertId());
+	if (!select.exec())
+	{
+		queryError(select);
+		return false;
+	}
+
+	if (select.next())
+		*record = historyRecord(select);
+
+	select.finish();
+	return !record->isEmpty();
+}
+
+bool Database::setRelayed(int id, bool relayed)
+{
+	METRIC_DB("setRelayed");
+	QSqlQuery &query = statement(Statement::SetRelayed);
+	query.bindValue(":id", id);
+	query.bindValue(":read", relayed);
 
+	if (!query.exec())
+	{
+		queryError(query);
+		return false;
+	}
+
+	return true;
+}
+
+bool Database::appendHistoryBatch(const QJsonArray &array, QList<bool> &results)
+{
+	METRIC_DB("appendHistoryBatch");
+	results.clear();
+
+	// One statement per row inside one write lock, keep it short
+	if (array.size() > GetSettings()->params()["historyBatchLimit"].toInt())
+	{
+		LOGW("History batch is too large: " << array.size());
+		results.fill(false, array.size());
+		return false;
+	}
+
+	// Runs in the caller's transaction, the history writer commits the batch as one group
+	QSqlQuery &query = statement(Statement::AppendHistory);
+	for (const QJsonValue &value : array)
+		results.push_back(insertHistory(query, value.toObject()));
+
+	return !results.contains(false);
+}
+
+bool Database::insertHistory(QSqlQuery &query, const QJsonObject &object, bool read)
+{
 	query.bindValue(":hid", object["hid"].toInt());
 	query.bindValue(":cid", object["cid"].toInt());
 	query.bindValue(":rid",  object["rid"].toInt());
 	query.bindValue(":text", object["text"].toString());
-	query.bindValue(":read", false);
+	query.bindValue(":read", read);
 	query.bindValue(":state", static_cast<int>(HistoryState::Regular));
 	query.bindValue(":ts", QVariant(QDateTime::currentDateTime().toString("dd.MM.yyyy hh:mm:ss")));
 
 	if (!query.exec())
 	{
-		LOGE(query.lastError().text().toStdString());
+		queryError(query);
 		return false;
 	}
 
@@ -117,9 +694,8 @@ bool Database::appendHistory(const QJsonObject &object)
 
 bool Database::modifyHistory(const QJsonObject &object)
 {
-	QSqlQuery query(db_);
-	query.prepare("UPDATE " + QString(kHistoryName) + " SET text = :text, state = :state, read = :read"
-													  " WHERE hid = :hid AND cid = :cid AND rid = :rid");
+	METRIC_DB("modifyHistory");
+	QSqlQuery &query = statement(Statement::ModifyHistory);
 	query.bindValue(":hid", object["hid"].toInt());
 	query.bindValue(":cid", object["cid"].toInt());
 	query.bindValue(":rid", object["rid"].toInt());
@@ -129,7 +705,7 @@ bool Database::modifyHistory(const QJsonObject &object)
 
 	if (!query.exec())
 	{
-		LOGE(query.lastError().text().toStdString());
+		queryError(query);
 		return false;
 	}
 
@@ -138,9 +714,8 @@ bool Database::modifyHistory(const QJsonObject &object)
 
 bool Database::modifyRemoveHistory(const QJsonObject& object)
 {
-	QSqlQuery query(db_);
-	query.prepare("UPDATE " + QString(kHistoryName) + " SET state = :state, read = :read"
-													  " WHERE hid = :hid AND cid = :cid AND rid = :rid");
+	METRIC_DB("modifyRemoveHistory");
+	QSqlQuery &query = statement(Statement::ModifyRemoveHistory);
 	query.bindValue(":hid", object["hid"].toInt());
 	query.bindValue(":cid", object["cid"].toInt());
 	query.bindValue(":rid", object["rid"].toInt());
@@ -149,7 +724,7 @@ bool Database::modifyRemoveHistory(const QJsonObject& object)
 
 	if (!query.exec())
 	{
-		LOGE(query.lastError().text().toStdString());
+		queryError(query);
 		return false;
 	}
 
@@ -158,15 +733,15 @@ bool Database::modifyRemoveHistory(const QJsonObject& object)
 
 bool Database::removeHistory(const QJsonObject &object)
 {
-	QSqlQuery query(db_);
-	query.prepare("DELETE FROM " + QString(kHistoryName) + " WHERE hid = :hid AND cid = :cid AND rid = :rid");
+	METRIC_DB("removeHistory");
+	QSqlQuery &query = statement(Statement::RemoveHistory);
 	query.bindValue(":hid", object["hid"].toInt());
 	query.bindValue(":cid", object["cid"].toInt());
 	query.bindValue(":rid", object["rid"].toInt());
 
 	if (!query.exec())
 	{
-		LOGE(query.lastError().text().toStdString());
+		queryError(query);
 		return false;
 	}
 
@@ -175,13 +750,13 @@ bool Database::removeHistory(const QJsonObject &object)
 
 bool Database::clearHistory(int cid)
 {
-	QSqlQuery query(db_);
-	query.prepare("DELETE FROM " + QString(kHistoryName) + " WHERE cid = :cid OR rid = :cid");
+	METRIC_DB("clearHistory");
+	QSqlQuery &query = statement(Statement::ClearHistory);
 	query.bindValue(":cid", cid);
 
 	if (!query.exec())
 	{
-		LOGE(query.lastError().text().toStdString());
+		queryError(query);
 		return false;
 	}
 
@@ -190,181 +765,447 @@ bool Database::clearHistory(int cid)
 
 bool Database::queryHistory(VariantMapList& mapList, const QVariantMap &options)
 {
+	METRIC_DB("queryHistory");
 	mapList.clear();
-	QSqlQuery query(db_);
 
-	if (options["all"].toBool())
-		query.prepare("SELECT * FROM " + QString(kHistoryName) +
-					  " WHERE (rid = " + QString::number(options["cid"].toInt()) +
-					  " OR cid = " + QString::number(options["cid"].toInt()) +
-					  ") AND state != " + QString::number(static_cast<int>(HistoryState::Removed)));
-
-	else if (options["state"].toInt() == static_cast<int>(HistoryState::Modified))
-		query.prepare("SELECT * FROM " + QString(kHistoryName) +
-					  " WHERE read IS FALSE"
-					  " AND state = " + QString::number(static_cast<int>(HistoryState::Modified)) +
-					  " AND rid = " + QString::number(options["cid"].toInt()));
-
-	else if (options["state"].toInt() == static_cast<int>(HistoryState::Removed))
-		query.prepare("SELECT * FROM " + QString(kHistoryName) +
-					  " WHERE read IS FALSE"
-					  " AND state = " + QString::number(static_cast<int>(HistoryState::Removed)) +
-					  " AND rid = " + QString::number(options["cid"].toInt()));
+	QSqlQuery &query = statement(options["all"].toBool() ? Statement::QueryAllHistory :
+															Statement::QueryPendingHistory);
+	query.bindValue(":cid", options["cid"].toInt());
 
+	// All history skips removed messages, pending history skips relayed new messages
+	if (options["all"].toBool())
+		query.bindValue(":state", static_cast<int>(HistoryState::Removed));
 	else
-		query.prepare("SELECT * FROM " + QString(kHistoryName) +
-					  " WHERE read IS FALSE"
-					  " AND state = " + QString::number(static_cast<int>(HistoryState::Regular)) +
-					  " AND rid = " + QString::number(options["cid"].toInt()));
+	{
+		query.bindValue(":state", static_cast<int>(HistoryState::Regular));
+		query.bindValue(":limit", options.value("limit", -1).toInt()); // -1 - no limit
+	}
 
 	if (!query.exec())
 	{
-		LOGE(query.lastError().text().toStdString());
+		queryError(query);
 		return false;
 	}
 
+	// Pending history of every state in one pass, unless one state is asked for
+	bool filter = !options["all"].toBool() && options.contains("state");
+	int state = options["state"].toInt();
 	while (query.next())
 	{
-		QVariantMap history;
-		history["hid"] = query.value("id").toInt();
-		history["cid"] = query.value("cid").toInt();
-		history["rid"] = query.value("rid").toInt();
-		history["text"] = query.value("text").toString();
-		history["read"] = query.value("read").toBool();
-		history["state"] = query.value("state").toInt();
-		history["ts"] = query.value("ts").toDateTime();
-		mapList.push_back(history);
+		if (!filter || query.value("state").toInt() == state)
+			mapList.push_back(historyRecord(query));
 	}
 
+	query.finish();
 	return mapList.size() > 0;
 }
 
-bool Database::setReadHistory(int cid)
+QVariantMap Database::historyRecord(const QSqlQuery &query)
 {
-	QSqlQuery query(db_);
-	query.prepare("UPDATE " + QString(kHistoryName) + " SET read = 1 WHERE rid = :rid OR cid = :rid");
-	query.bindValue(":rid", cid);
+	QVariantMap history;
+	history["hid"] = query.value("id").toInt();
+	history["cid"] = query.value("cid").toInt();
+	history["rid"] = query.value("rid").toInt();
+	history["text"] = query.value("text").toString();
+	// Read by the recipient, from its read cursor; the "read" column only says the row was relayed
+	history["read"] = query.value("readBy").toBool();
+	history["state"] = query.value("state").toInt();
+	history["ts"] = query.value("ts").toDateTime();
+	history["seq"] = query.value("seq").toLongLong();
+	return history;
+}
+
+IntList Database::queryConversations(int cid)
+{
+	METRIC_DB("queryConversations");
+	IntList peers;
+	QSqlQuery &query = statement(Statement::QueryConversations);
+	query.bindValue(":cid", cid);
 
 	if (!query.exec())
 	{
-		LOGE(query.lastError().text().toStdString());
+		queryError(query);
+		return peers;
+	}
+
+	while (query.next())
+		peers.push_back(query.value(0).toInt());
+
+	query.finish();
+	return peers;
+}
+
+bool Database::queryHistoryPage(VariantMapList &mapList, int cid, int rid, int before, int after, int limit)
+{
+	METRIC_DB("queryHistoryPage");
+	mapList.clear();
+
+	// Newest page below "before", or oldest page above "after" when only "after" is set
+	QSqlQuery &query = statement(after > 0 && before <= 0 ? Statement::QueryHistoryPageAfter :
+															Statement::QueryHistoryPageBefore);
+	query.bindValue(":cid", cid);
+	query.bindValue(":rid", rid);
+	query.bindValue(":before", before > 0 ? before : std::numeric_limits<int>::max());
+	query.bindValue(":after", after > 0 ? after : 0);
+	query.bindValue(":state", static_cast<int>(HistoryState::Removed));
+	query.bindValue(":limit", limit);
+
+	if (!query.exec())
+	{
+		queryError(query);
+		return false;
+	}
+
+	while (query.next())
+		mapList.push_back(historyRecord(query));
+
+	query.finish();
+	return mapList.size() > 0;
+}
+
+bool Database::queryHistoryHeads(VariantMapList &mapList, int cid, int limit)
+{
+	METRIC_DB("queryHistoryHeads");
+	mapList.clear();
+
+	VariantMapList page;
+	for (int rid : queryConversations(cid))
+	{
+		if (queryHistoryPage(page, cid, rid, 0, 0, limit))
+			mapList.append(page);
+	}
+
+	return mapList.size() > 0;
+}
+
+bool Database::syncHistory(VariantMapList &mapList, int cid, int rid, qint64 since, int limit)
+{
+	METRIC_DB("syncHistory");
+	mapList.clear();
+
+	// Removed messages are included, the client drops them
+	QSqlQuery &query = statement(rid > 0 ? Statement::SyncConversation : Statement::SyncHistory);
+	query.bindValue(":cid", cid);
+	if (rid > 0)
+		query.bindValue(":rid", rid);
+	query.bindValue(":since", since);
+	query.bindValue(":limit", limit);
+
+	if (!query.exec())
+	{
+		queryError(query);
+		return false;
+	}
+
+	while (query.next())
+		mapList.push_back(historyRecord(query));
+
+	query.finish();
+	return mapList.size() > 0;
+}
+
+qint64 Database::queryHistorySeq()
+{
+	METRIC_DB("queryHistorySeq");
+	QSqlQuery &query = statement(Statement::QueryHistorySeq);
+	if (!query.exec() || !query.next())
+	{
+		queryError(query);
+		return 0;
+	}
+
+	qint64 seq = query.value(0).toLongLong();
+	query.finish();
+	return seq;
+}
+
+bool Database::searchHistory(VariantMapList &mapList, const QString &text, int cid, int limit, int offset)
+{
+	METRIC_DB("searchHistory");
+	mapList.clear();
+
+	// Quote every word as an FTS5 string, so user input is never parsed as query syntax.
+	// Words of punctuation only hold no token and would match nothing, they are skipped.
+	// The last word matches as a prefix while the user is still typing.
+	static const QRegularExpression space("\\s+");
+	static const QRegularExpression word("[\\p{L}\\p{N}]");
+	QStringList terms;
+	for (QString term : text.split(space, Qt::SkipEmptyParts))
+	{
+		if (term.contains(word))
+			terms.push_back("\"" + term.replace("\"", "\"\"") + "\"");
+	}
+
+	if (terms.isEmpty())
+		return false;
+
+	terms.last() += "*";
+
+	QSqlQuery &query = statement(Statement::SearchHistory);
+	query.bindValue(":text", terms.join(' '));
+	query.bindValue(":cid", cid);
+	query.bindValue(":state", static_cast<int>(HistoryState::Removed));
+	query.bindValue(":limit", limit);
+	query.bindValue(":offset", offset);
+
+	if (!query.exec())
+	{
+		queryError(query);
+		return false;
+	}
+
+	while (query.next())
+		mapList.push_back(historyRecord(query));
+
+	query.finish();
+	return mapList.size() > 0;
+}
+
+bool Database::setDeliveredSeq(int cid, qint64 seq)
+{
+	METRIC_DB("setDeliveredSeq");
+	QSqlQuery &query = statement(Statement::SetDeliveredSeq);
+	query.bindValue(":reader", cid);
+	query.bindValue(":seq", seq);
+
+	if (!query.exec())
+	{
+		queryError(query);
 		return false;
 	}
 
 	return true;
 }
 
-int Database::appendContact(const QJsonObject &object)
+bool Database::setReadCursor(int reader, int peer, int hid)
 {
-	QSqlQuery query(db_);
-	query.prepare("INSERT INTO " + QString(kContactsName) + " (name, login, password, image, phone, ts)"
-															" VALUES (:name, :login, :password, :image, :phone, :ts)");
+	METRIC_DB("setReadCursor");
+	QSqlQuery &query = statement(Statement::SetReadCursor);
+	query.bindValue(":reader", reader);
+	query.bindValue(":peer", peer);
+	query.bindValue(":hid", hid);
+
+	if (!query.exec())
+	{
+		queryError(query);
+		return false;
+	}
+
+	return true;
+}
+
+bool Database::queryUnread(QJsonArray &unread, int reader)
+{
+	METRIC_DB("queryUnread");
+	QSqlQuery &cursors = statement(Statement::QueryReadCursors);
+	cursors.bindValue(":reader", reader);
+	if (!cursors.exec())
+	{
+		queryError(cursors);
+		return false;
+	}
+
+	QHash<int, int> readUpTo;
+	while (cursors.next())
+		readUpTo[cursors.value("peer").toInt()] = cursors.value("hid").toInt();
+	cursors.finish();
+
+	// One index range count per conversation, from its read cursor on
+	QSqlQuery &query = statement(Statement::CountUnread);
+	for (int peer : queryConversations(reader))
+	{
+		query.bindValue(":peer", peer);
+		query.bindValue(":reader", reader);
+		query.bindValue(":hid", readUpTo.value(peer));
+		query.bindValue(":state", static_cast<int>(HistoryState::Removed));
+		if (!query.exec() || !query.next())
+		{
+			queryError(query);
+			return false;
+		}
+
+		int count = query.value(0).toInt();
+		query.finish();
+		if (count == 0)
+			continue;
+
+		QJsonObject conversation;
+		conversation["rid"] = peer;
+		conversation["hid"] = readUpTo.value(peer);
+		conversation["count"] = count;
+		unread.push_back(conversation);
+	}
+
+	return true;
+}
 
+int Database::appendContact(const QJsonObject &object)
+{
+	METRIC_DB("appendContact");
+	QSqlQuery &query = statement(Statement::AppendContact);
 	query.bindValue(":name", object["name"].toString());
 	query.bindValue(":login", object["login"].toString());
 	query.bindValue(":password", object["password"].toString());
-	query.bindValue(":image", object["image"].toString());
+	query.bindValue(":avatar", storeAvatar(object));
 	query.bindValue(":phone", object["phone"].toString());
 	query.bindValue(":ts", QVariant(QDateTime::currentDateTime().toString("dd.MM.yyyy hh:mm:ss")));
 
 	if (!query.exec())
 	{
-		LOGE(query.lastError().text().toStdString());
+		queryError(query);
 		return 0;
 	}
 
-	// Query contact id
-	query.prepare("SELECT id FROM " + QString(kContactsName));
-	if (!query.exec())
-	{
-		LOGE(query.lastError().text().toStdString());
-		return 0;
-	}
+	GetContactCache()->invalidate(object["login"].toString());
 
-	query.last();
-	return query.value(0).toInt();
+	return query.lastInsertId().toInt();
 }
 
 bool Database::modifyContact(const QJsonObject &object)
 {
-	QSqlQuery query(db_);
-	query.prepare("UPDATE " + QString(kContactsName) + " SET name = :name, login = :login,"
-													   " password = :password. image = :image, "
-													   "phone = :phone WHERE id = :id");
-
+	METRIC_DB("modifyContact");
+	QSqlQuery &query = statement(Statement::ModifyContact);
 	query.bindValue(":id", object["id"].toInt());
 	query.bindValue(":name", object["name"].toString());
 	query.bindValue(":login", object["login"].toString());
 	query.bindValue(":password", object["password"].toString());
-	query.bindValue(":image", object["image"].toString());
+	query.bindValue(":avatar", storeAvatar(object));
 	query.bindValue(":phone", object["phone"].toString());
 
 	if (!query.exec())
 	{
-		LOGE(query.lastError().text().toStdString());
+		queryError(query);
 		return false;
 	}
 
+	// After the write, so a concurrent load can't cache the old row again
+	GetContactCache()->invalidate(object["id"].toInt());
+
 	return true;
 }
 
 bool Database::removeContact(const QJsonObject &object)
 {
-	QSqlQuery query(db_);
-	query.prepare("DELETE FROM " + QString(kContactsName) + " WHERE id = :id");
+	METRIC_DB("removeContact");
+	QSqlQuery &query = statement(Statement::RemoveContact);
 	query.bindValue(":id", object["id"].toInt());
 
 	if (!query.exec())
 	{
-		LOGE(query.lastError().text().toStdString());
+		queryError(query);
 		return false;
 	}
 
+	GetContactCache()->invalidate(object["id"].toInt());
+
 	return true;
 }
 
 bool Database::contactExists(const QJsonObject &object) const
 {
-	QSqlQuery query(db_);
-	query.prepare("SELECT login FROM " + QString(kContactsName) + " WHERE login = :login");
-	query.bindValue(":login", object["login"].toString());
+	METRIC_DB("contactExists");
+	bool ok = true;
+	ContactRecordPtr record = loadContact(object["login"].toString(), ok);
+
+	// Report an existing login on errors, so registration never duplicates it
+	return !ok || record != nullptr;
+}
+
+QString Database::queryPassword(const QString &login) const
+{
+	METRIC_DB("queryPassword");
+	bool ok = true;
+	ContactRecordPtr record = loadContact(login, ok);
+	return record != nullptr ? record->password : "";
+}
+
+ContactRecordPtr Database::loadContact(const QString &login, bool &ok) const
+{
+	ok = true;
+	ContactRecordPtr record = GetContactCache()->find(login);
+	if (record != nullptr)
+		return record;
 
+	QSqlQuery &query = statement(Statement::QueryContactByLogin);
+	query.bindValue(":login", login);
 	if (!query.exec())
 	{
-		LOGE(query.lastError().text().toStdString());
-		return true;
+		queryError(query);
+		ok = false;
+		return nullptr;
+	}
+
+	if (query.next())
+	{
+		record = contactRecord(query);
+		GetContactCache()->put(record);
 	}
 
-	return query.next();
+	query.finish();
+	return record;
 }
 
-QString Database::queryPassword(const QString &login) const
+ContactRecordPtr Database::loadContact(int id, bool &ok) const
 {
-	QSqlQuery query(db_);
-	query.prepare("SELECT password FROM " + QString(kContactsName) + " WHERE login = :login");
-	query.bindValue(":login", login);
+	ok = true;
+	ContactRecordPtr record = GetContactCache()->find(id);
+	if (record != nullptr)
+		return record;
 
+	QSqlQuery &query = statement(Statement::QueryContactById);
+	query.bindValue(":id", id);
 	if (!query.exec())
 	{
-		LOGE(query.lastError().text().toStdString());
-		return "";
+		queryError(query);
+		ok = false;
+		return nullptr;
 	}
 
-	if (!query.next())
-		return "";
+	if (query.next())
+	{
+		record = contactRecord(query);
+		GetContactCache()->put(record);
+	}
 
-	query.first();
-	return query.value(0).toString();
+	query.finish();
+	return record;
+}
+
+QString Database::storeAvatar(const QJsonObject &object)
+{
+	// Already uploaded image
+	QString hash = object["avatar"].toString();
+	if (GetAvatarStore()->contains(hash))
+		return hash;
+
+	QString image = object["image"].toString();
+	if (image.isEmpty())
+		return QString();
+
+	return GetAvatarStore()->put(QByteArray::fromBase64(image.toLatin1()));
+}
+
+ContactRecordPtr Database::contactRecord(const QSqlQuery &query)
+{
+	QSharedPointer<ContactRecord> record = QSharedPointer<ContactRecord>::create();
+	record->id = query.value("id").toInt();
+	record->name = query.value("name").toString();
+	record->login = query.value("login").toString();
+	record->password = query.value("password").toString();
+	record->avatar = query.value("avatar").toString();
+	record->phone = query.value("phone").toString();
+	return record;
 }
 
 bool Database::searchContacts(QJsonObject &object, const QString &name, int cid)
 {
-	QSqlQuery query(db_);
-	query.prepare("SELECT * FROM " + QString(kContactsName) + " WHERE login LIKE '%" + name + "%'");
+	METRIC_DB("searchContacts");
+	QSqlQuery &query = statement(Statement::SearchContacts);
+	query.bindValue(":pattern", "%" + name + "%");
 
 	if (!query.exec())
 	{
-		LOGE(query.lastError().text().toStdString());
+		queryError(query);
 		return false;
 	}
 
@@ -376,109 +1217,98 @@ bool Database::searchContacts(QJsonObject &object, const QString &name, int cid)
 			continue;
 
 		QJsonObject contact;
-		contact["id"] = query.value("id").toInt();
-		contact["name"] = query.value("name").toString();
-		contact["login"] = query.value("login").toString();
-		contact["image"] = query.value("image").toString();
-		contact["phone"] = query.value("phone").toString();
+		contactRecord(query)->toJson(contact);
 		array.push_back(contact);
 	}
 
+	query.finish();
 	object["contacts"] = array;
 	return array.size() > 0;
 }
 
 bool Database::queryContact(QJsonObject &contact, const QString &login)
 {
-	QSqlQuery query(db_);
-	query.prepare("SELECT * FROM " + QString(kContactsName) + " WHERE login = :login");
-	query.bindValue(":login", login);
-
-	if (!query.exec())
-	{
-		LOGE(query.lastError().text().toStdString());
+	METRIC_DB("queryContactByLogin");
+	bool ok = true;
+	ContactRecordPtr record = loadContact(login, ok);
+	if (!ok)
 		return true;
-	}
 
-	if (!query.next())
+	if (record == nullptr)
 		return false;
 
-	contact["id"] = query.value("id").toInt();
-	contact["name"] = query.value("name").toString();
-	contact["login"] = query.value("login").toString();
-	contact["image"] = query.value("image").toString();
-	contact["phone"] = query.value("phone").toString();
+	record->toJson(contact);
+
+	// Linked contacts in one round trip
+	QJsonArray links;
+	queryLinkedContacts(links, record->id);
+	contact["links"] = links;
+	return true;
+}
+
+bool Database::queryLinkedContacts(QJsonArray &contacts, int cid)
+{
+	METRIC_DB("queryLinkedContacts");
+	QSqlQuery &query = statement(Statement::QueryLinkedContacts);
+	query.bindValue(":cid", cid);
 
-	// Links
-	query.prepare("SELECT * FROM " + QString(kLinkContactsName) + " WHERE cid = :cid");
-	query.bindValue(":cid", contact["id"].toInt());
 	if (!query.exec())
 	{
-		LOGE(query.lastError().text().toStdString());
-		return true;
+		queryError(query);
+		return false;
 	}
 
-	if (!query.next())
-		return true;
-
-	QJsonArray links;
 	while (query.next())
 	{
-		QJsonObject link;
-		link["cid"] = query.value("cid").toInt();
-		link["rid"] = query.value("rid").toInt();
-		links.push_back(link);
+		ContactRecordPtr record = contactRecord(query);
+		GetContactCache()->put(record);
+
+		QJsonObject contact;
+		record->toJson(contact);
+		contacts.push_back(contact);
 	}
 
-	contact["links"] = links;
+	query.finish();
 	return true;
 }
 
 bool Database::queryContact(QJsonObject& contact, int id)
 {
-	QSqlQuery query(db_);
-	query.prepare("SELECT * FROM " + QString(kContactsName) + " WHERE id = :id");
-	query.bindValue(":id", id);
-
-	if (!query.exec())
-	{
-		LOGE(query.lastError().text().toStdString());
+	METRIC_DB("queryContactById");
+	bool ok = true;
+	ContactRecordPtr record = loadContact(id, ok);
+	if (!ok)
 		return true;
-	}
 
-	if (!query.next())
+	if (record == nullptr)
 		return false;
 
-	contact["id"] = query.value("id").toInt();
-	contact["name"] = query.value("name").toString();
-	contact["login"] = query.value("login").toString();
-	contact["image"] = query.value("image").toString();
-	contact["phone"] = query.value("phone").toString();
+	record->toJson(contact);
 	return true;
 }
 
 bool Database::linkExists(const QJsonObject& object)
 {
-	QSqlQuery query(db_);
-	query.prepare("SELECT rid FROM " + QString(kLinkContactsName) + " WHERE cid = :cid AND rid = :rid");
+	METRIC_DB("linkExists");
+	QSqlQuery &query = statement(Statement::LinkExists);
 	query.bindValue(":cid", object["cid"].toInt());
 	query.bindValue(":rid", object["rid"].toInt());
 
 	if (!query.exec())
 	{
-		LOGE(query.lastError().text().toStdString());
+		queryError(query);
 		return false;
 	}
 
-	return query.next();
+	bool exists = query.next();
+	query.finish();
+	return exists;
 }
 
 bool Database::linkContact(const QJsonObject &object)
 {
-	QSqlQuery query(db_);
-	query.prepare("INSERT INTO " + QString(kLinkContactsName) + " (cid, rid, approved, ts)"
-																" VALUES (:cid, :rid, :approved, :ts)");
-
+	METRIC_DB("linkContact");
+	QSqlQuery &query = statement(Statement::LinkContact);
 	query.bindValue(":cid", object["cid"].toInt());
 	query.bindValue(":rid", object["rid"].toInt());
 	query.bindValue(":approved", object["rapprovedid"].toBool());
@@ -486,7 +1316,7 @@ bool Database::linkContact(const QJsonObject &object)
 
 	if (!query.exec())
 	{
-		LOGE(query.lastError().text().toStdString());
+		queryError(query);
 		return false;
 	}
 
@@ -495,14 +1325,14 @@ bool Database::linkContact(const QJsonObject &object)
 
 bool Database::unlinkContact(const QJsonObject &object)
 {
-	QSqlQuery query(db_);
-	query.prepare("DELETE FROM " + QString(kLinkContactsName) + " WHERE cid = :cid AND rid = :rid");
+	METRIC_DB("unlinkContact");
+	QSqlQuery &query = statement(Statement::UnlinkContact);
 	query.bindValue(":cid", object["cid"].toInt());
 	query.bindValue(":rid", object["rid"].toInt());
 
 	if (!query.exec())
 	{
-		LOGE(query.lastError().text().toStdString());
+		queryError(query);
 		return false;
 	}
 
@@ -511,19 +1341,20 @@ bool Database::unlinkContact(const QJsonObject &object)
 
 IntList Database::queryLinks(int cid)
 {
+	METRIC_DB("queryLinks");
 	IntList rids;
-	QSqlQuery query(db_);
-	query.prepare("SELECT rid FROM " + QString(kLinkContactsName) + " WHERE cid = :cid");
+	QSqlQuery &query = statement(Statement::QueryLinks);
 	query.bindValue(":cid", cid);
 
 	if (!query.exec())
 	{
-		LOGE(query.lastError().text().toStdString());
+		queryError(query);
 		return rids;
 	}
 
 	while (query.next())
 		rids.push_back(query.value("rid").toInt());
 
+	query.finish();
 	return rids;
 }
@@ -12,8 +12,13 @@
 #include <QDateTime>
 #include <QSharedPointer>
 #include <QJsonObject>
+#include <QJsonArray>
 #include <QList>
 
+#include <unordered_map>
+
+#include "contactcache.h"
+
 using HistoryRecord = std::tuple<QString, QString, QDateTime>;
 using JsonObjectList = QList<QJsonObject>;
 using IntList = QList<int>;
@@ -33,8 +38,67 @@ class Database : public QObject
 
 	Q_OBJECT
 
+public:
+	struct StatementStats
+	{
+		quint64 hits;
+		quint64 misses;
+		qint64 prepareTime; // us spent in prepare()
+		qint64 savedTime; // us not spent thanks to cache hits, estimated from the average prepare time
+	};
+
+private:
+	// Cached prepared statements, one per id for the connection lifetime
+	enum class Statement
+	{
+		AppendHistory,
+		ModifyHistory,
+		ModifyRemoveHistory,
+		RemoveHistory,
+		ClearHistory,
+		QueryAllHistory,
+		QueryHistoryRecord,
+		SetRelayed,
+		QueryPendingHistory,
+		QueryConversations,
+		QueryHistoryPageBefore,
+		QueryHistoryPageAfter,
+		SearchHistory,
+		SyncHistory,
+		SyncConversation,
+		QueryHistorySeq,
+		SetDeliveredSeq,
+		SetReadCursor,
+		QueryReadCursors,
+		CountUnread,
+		AppendContact,
+		ModifyContact,
+		RemoveContact,
+		SearchContacts,
+		QueryContactByLogin,
+		QueryContactById,
+		QueryLinkedContacts,
+		LinkExists,
+		LinkContact,
+		UnlinkContact,
+		QueryLinks
+	};
+
+	// Schema upgrade step, applied once when PRAGMA user_version is below its version
+	struct Migration
+	{
+		int version;
+		const char *description;
+		bool (Database::*apply)();
+	};
+
 private:
 	QSqlDatabase db_;
+	mutable std::unordered_map<Statement, QSqlQuery> statements_;
+	mutable QSqlQuery failedStatement_; // Last statement that failed to prepare, not cached
+	mutable quint64 statementHits_;
+	mutable quint64 statementMisses_;
+	mutable qint64 prepareTime_;
 
 private:
 	Database();
@@ -48,13 +112,23 @@ public:
 	Database& operator= (Database&&) = delete;
 
 public:
-	bool appendHistory(const QJsonObject &object);
+	bool appendHistory(const QJsonObject &object, bool read = false, QVariantMap *record = nullptr);
+	bool appendHistoryBatch(const QJsonArray &array, QList<bool> &results);
+	bool setRelayed(int id, bool relayed);
 	bool modifyHistory(const QJsonObject &object);
 	bool modifyRemoveHistory(const QJsonObject &object);
 	bool removeHistory(const QJsonObject &object);
 	bool clearHistory(int cid);
 	bool queryHistory(VariantMapList &list, const QVariantMap &options);
-	bool setReadHistory(int cid);
+	bool setDeliveredSeq(int cid, qint64 seq);
+	bool setReadCursor(int reader, int peer, int hid);
+	bool queryUnread(QJsonArray &unread, int reader);
+	IntList queryConversations(int cid);
+	bool queryHistoryPage(VariantMapList &list, int cid, int rid, int before, int after, int limit);
+	bool queryHistoryHeads(VariantMapList &list, int cid, int limit);
+	bool searchHistory(VariantMapList &list, const QString &text, int cid, int limit, int offset);
+	bool syncHistory(VariantMapList &list, int cid, int rid, qint64 since, int limit);
+	qint64 queryHistorySeq();
 
 	int appendContact(const QJsonObject &object);
 	bool modifyContact(const QJsonObject &object);
@@ -64,6 +138,7 @@ public:
 	bool searchContacts(QJsonObject &object, const QString &name, int cid);
 	bool queryContact(QJsonObject &contact, const QString &login);
 	bool queryContact(QJsonObject &contact, int cid);
+	bool queryLinkedContacts(QJsonArray &contacts, int cid);
 	bool linkExists(const QJsonObject &object);
 	bool linkContact(const QJsonObject &object);
 	bool unlinkContact(const QJsonObject &object);
@@ -73,18 +148,48 @@ public:
 	bool open();
 	void close();
 	bool isOpen() const { return db_.isOpen(); }
+	bool beginTransaction();
+	bool commitTransaction();
+	void rollbackTransaction();
+	StatementStats statementStats() const;
 
 private:
+	bool setupConnection();
+	bool migrate();
+	bool execute(QSqlQuery &query, const QString &sql);
+	QSqlQuery &statement(Statement id) const;
+	void queryError(const QSqlQuery &query) const;
+	static QVariantMap historyRecord(const QSqlQuery &query);
+	static ContactRecordPtr contactRecord(const QSqlQuery &query);
+	static QString storeAvatar(const QJsonObject &object);
+	ContactRecordPtr loadContact(const QString &login, bool &ok) const;
+	ContactRecordPtr loadContact(int id, bool &ok) const;
+	bool insertHistory(QSqlQuery &query, const QJsonObject &object, bool read = false);
+	static QString statementText(Statement id);
+	static const QList<Migration> &migrations();
+
+	// Migrations
 	bool createTables();
+	bool createIndexes();
+	bool createConversationIndexes();
+	bool createHistoryFts();
+	bool moveAvatars();
+	bool createHistorySeq();
+	bool createCursors();
+	bool createSeqCounter();
 };
 
 using DatabasePtr = QSharedPointer<Database>;
 
+// Qt allows a connection to be used only by the thread that opened it,
+// so every thread gets its own Database, opened on first use
 inline DatabasePtr GetDatabase()
 {
-	static DatabasePtr database = nullptr;
+	static thread_local DatabasePtr database = nullptr;
 	if (database == nullptr)
 		database = QSharedPointer<Database>::create();
+	if (!database->isOpen())
+		database->open();
 	return database;
 }
 
@@ -4,7 +4,11 @@
 constexpr char kDbName[] = "data.db";
 constexpr char kDbHostName[] = "database";
 constexpr char kHistoryName[] = "history";
+constexpr char kHistoryFtsName[] = "history_fts";
 constexpr char kContactsName[] = "contacts";
 constexpr char kLinkContactsName[] = "linkcontacts";
+constexpr char kDeliveryCursorsName[] = "deliverycursors";
+constexpr char kReadCursorsName[] = "readcursors";
+constexpr char kHistorySeqName[] = "historyseq";
 
 #endif // DBNAMES_H
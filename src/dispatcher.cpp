@@ -1,11 +1,18 @@
 #include "dispatcher.h"
 #include "log.h"
 #include "database.h"
+#include "settings.h"
+#include "metrics.h"
+#include "common.h"
+#include "avatarstore.h"
+#include "sessiontokens.h"
 
 #include <QJsonDocument>
 #include <QJsonObject>
 #include <QJsonArray>
+#include <QCborMap>
 #include <QCryptographicHash>
+#include <QSet>
 
 Dispatcher::Dispatcher()
 {
@@ -28,33 +35,93 @@ bool Dispatcher::start()
 		return false;
 
 	connect(&server_, &Server::messageReceived, this, &Dispatcher::processMessage);
+	connect(&server_, &Server::binaryMessageReceived, this, &Dispatcher::processBinaryMessage);
+	outbound_.start();
+	workers_.start(GetSettings()->params()["workers"].toInt());
+	writer_.start();
 	clientService_.start();
+	if (!shards_.start(clientService_, outbound_))
+		return false;
+
+	GetMetrics()->gauge("clients.registered", [this]() { return clientService_.size(); });
+	// Outbound is read on the main thread, where the metrics endpoint and the dump timer run
+	GetMetrics()->gauge("outbound.queuedBytes", [this]() { return static_cast<double>(outbound_.queuedBytes()); });
+	GetMetrics()->gauge("outbound.bufferedBytes", [this]() { return static_cast<double>(outbound_.bufferedBytes()); });
+	GetMetrics()->gauge("outbound.maxSocketBytes", [this]() { return static_cast<double>(outbound_.maxSocketBytes()); });
+	GetMetrics()->gauge("outbound.queuedSockets", [this]() { return outbound_.slowSockets(); });
+	GetMetrics()->gauge("historyWriter.depth", [this]() { return static_cast<double>(writer_.depth()); });
+	GetMetrics()->gauge("log.queueDepth", []() {
+		LoggerPtr log = Log::instance();
+		return log != nullptr ? static_cast<double>(log->queueDepth()) : 0.0;
+	});
+	GetMetrics()->gauge("log.dropped", []() {
+		LoggerPtr log = Log::instance();
+		return log != nullptr ? static_cast<double>(log->dropped()) : 0.0;
+	});
+
+	int metricsInterval = GetSettings()->params()["metricsInterval"].toInt();
+	if (metricsInterval > 0)
+	{
+		connect(&metricsTimer_, &QTimer::timeout, this, []() { GetMetrics()->dump(); });
+		metricsTimer_.start(metricsInterval * 1000);
+	}
+
 	return true;
 }
 
 void Dispatcher::stop()
 {
+	metricsTimer_.stop();
+	shards_.stop();
 	server_.stop();
-	GetDatabase()->close();
+	workers_.stop();
+	writer_.stop();
 	clientService_.stop();
+	GetDatabase()->close();
 }
 
 void Dispatcher::processMessage(const QString &message, QWebSocket *socket)
 {
-	logMessage(message);
+	// Messages of one socket always go to the same worker, so they keep their order
+	SocketRef ref(socket, Protocol::Json, compression(socket));
+	QByteArray data = message.toUtf8();
+	countReceived(data.size());
+	workers_.post(reinterpret_cast<quintptr>(socket), [this, data, ref]() {
+		execute(data, ref);
+	});
+}
+
+void Dispatcher::processBinaryMessage(const QByteArray &message, QWebSocket *socket)
+{
+	SocketRef ref(socket, Protocol::Cbor, compression(socket));
+	countReceived(message.size());
+	workers_.post(reinterpret_cast<quintptr>(socket), [this, message, ref]() {
+		execute(message, ref);
+	});
+}
 
-	QJsonParseError error;
-	QJsonDocument document = QJsonDocument::fromJson(message.toUtf8(), &error);
-	if (error.error != QJsonParseError::NoError)
+void Dispatcher::execute(const QByteArray &data, const SocketRef &socket)
+{
+	int64_t start = steady_micro();
+	QJsonObject rootObject;
+	QString error;
+	if (!decodeMessage(data, socket.protocol(), rootObject, error))
 	{
-		LOGE(error.errorString().toStdString());
+		LOGE(error.toStdString());
+		static Counter &errors = GetMetrics()->counter("dispatcher.decodeErrors");
+		errors.add();
 		return;
 	}
 
-	QJsonObject rootObject = document.object();
+	int64_t parsed = steady_micro();
+	logMessage(data, rootObject, socket.protocol());
+
 	if (rootObject.empty())
 		return;
 
+	RequestPhases &phases = Metrics::phases();
+	phases = RequestPhases();
+
 	Action action = static_cast<Action>(rootObject["action"].toInt());
 	if (action == Action::Registration)
 		actionRegistration(rootObject, socket);
@@ -78,14 +145,145 @@ void Dispatcher::processMessage(const QString &message, QWebSocket *socket)
 		actionRemoveHistory(rootObject, socket);
 	else if (action == Action::ClearHistory)
 		actionClearHistory(rootObject, socket);
+	else if (action == Action::QueryHistory)
+		actionQueryHistory(rootObject, socket);
+	else if (action == Action::AddHistoryBatch)
+		actionAddHistoryBatch(rootObject, socket);
+	else if (action == Action::QueryAvatar)
+		actionQueryAvatar(rootObject, socket);
+	else if (action == Action::Resume)
+		actionResume(rootObject, socket);
+	else if (action == Action::Sync)
+		actionSync(rootObject, socket);
+	else if (action == Action::ReadHistory)
+		actionReadHistory(rootObject, socket);
+	else
+		action = Action::None;
+
+	const ActionStats &stats = actionStats(action);
+	stats.calls->add();
+	if (phases.errors > 0)
+		stats.errors->add();
+	stats.total->record(steady_micro() - start);
+	stats.parse->record(parsed - start);
+	stats.db->record(phases.db);
+	stats.serialize->record(phases.serialize);
+}
+
+const ActionStats &Dispatcher::actionStats(Action action)
+{
+	static const QList<ActionStats> stats = []() {
+		QList<ActionStats> list;
+		for (int i = static_cast<int>(Action::None); i <= static_cast<int>(Action::ReadHistory); ++i)
+			list.push_back(GetMetrics()->actionStats(actionName(static_cast<Action>(i))));
+		return list;
+	}();
+
+	// Unknown codes count as None
+	int index = static_cast<int>(action);
+	return stats[index >= 0 && index < stats.size() ? index : 0];
+}
+
+const char *Dispatcher::actionName(Action action)
+{
+	switch (action)
+	{
+	case Action::None: return "None";
+	case Action::Registration: return "Registration";
+	case Action::Auth: return "Auth";
+	case Action::Message: return "Message";
+	case Action::Search: return "Search";
+	case Action::QueryContact: return "QueryContact";
+	case Action::LinkContact: return "LinkContact";
+	case Action::UnlinkContact: return "UnlinkContact";
+	case Action::AddHistory: return "AddHistory";
+	case Action::ModifyHistory: return "ModifyHistory";
+	case Action::RemoveHistory: return "RemoveHistory";
+	case Action::ClearHistory: return "ClearHistory";
+	case Action::NewHistory: return "NewHistory";
+	case Action::QueryHistory: return "QueryHistory";
+	case Action::AddHistoryBatch: return "AddHistoryBatch";
+	case Action::QueryAvatar: return "QueryAvatar";
+	case Action::Resume: return "Resume";
+	case Action::Sync: return "Sync";
+	case Action::ReadHistory: return "ReadHistory";
+	}
+
+	return "Unknown";
+}
+
+void Dispatcher::sendMessage(const QByteArray &message, const Client &client)
+{
+	outbound_.send(client.socket().get(), message, client.protocol(), Outbound::Kind::Push);
+}
+
+void Dispatcher::countReceived(qint64 size)
+{
+	static Counter &messages = GetMetrics()->counter("server.messagesIn");
+	static Counter &bytes = GetMetrics()->counter("server.bytesIn");
+	messages.add();
+	bytes.add(static_cast<uint64_t>(size));
+}
+
+Compression Dispatcher::compression(QWebSocket *socket) const
+{
+	ClientPtr client = clientService_.find(socket);
+	return client != nullptr ? client->compression() : Compression::None;
 }
 
-void Dispatcher::sendMessage(const QString &message, const Client &client)
+void Dispatcher::reply(const SocketRef &socket, const QJsonObject &object)
 {
-	client.socket()->sendTextMessage(message);
+	// Serialize on the worker, write on the socket's thread
+	int64_t start = steady_micro();
+	QByteArray data = encodeMessage(object, socket.protocol(), socket.compression());
+	Metrics::phases().serialize += steady_micro() - start;
+	replyData(socket, data);
+}
+
+void Dispatcher::replyData(const SocketRef &socket, const QByteArray &data)
+{
+	QMetaObject::invokeMethod(this, [this, socket, data]() {
+		if (socket)
+			outbound_.send(socket.data(), data, socket.protocol(), Outbound::Kind::Reply);
+	}, Qt::QueuedConnection);
+}
+
+void Dispatcher::send(const ClientPtr &client, const QJsonObject &object)
+{
+	int64_t start = steady_micro();
+	QByteArray data = encodeMessage(object, client->protocol(), client->compression());
+	Metrics::phases().serialize += steady_micro() - start;
+	QMetaObject::invokeMethod(this, [this, client, data]() {
+		sendMessage(data, *client);
+	}, Qt::QueuedConnection);
+}
+
+void Dispatcher::attach(const SocketRef &socket, int id, const QString &login, Protocol protocol,
+						Compression compression)
+{
+	// The socket may have disconnected while its auth was processed
+	QMetaObject::invokeMethod(this, [this, socket, id, login, protocol, compression]() {
+		if (socket && socket->state() == QAbstractSocket::ConnectedState)
+			clientService_.add(id, login, socket.data(), protocol, compression);
+	}, Qt::QueuedConnection);
+}
+
+ClientPtr Dispatcher::authorized(const SocketRef &socket, Action action)
+{
+	// Requests on the requester's own data take the id from the session, not from the request
+	ClientPtr client = clientService_.find(socket.data());
+	if (client == nullptr)
+	{
+		QJsonObject root;
+		root["action"] = static_cast<int>(action);
+		root["code"] = static_cast<int>(ErrorCode::Unauthorized);
+		reply(socket, root);
+	}
+
+	return client;
 }
 
-void Dispatcher::actionRegistration(QJsonObject &object, QWebSocket *socket)
+void Dispatcher::actionRegistration(QJsonObject &object, const SocketRef &socket)
 {
 	QJsonObject contact;
 	contact["action"] = static_cast<int>(Action::Registration);
@@ -100,10 +298,10 @@ void Dispatcher::actionRegistration(QJsonObject &object, QWebSocket *socket)
 		contact["id"] = GetDatabase()->appendContact(object);
 	}
 
-	socket->sendTextMessage(QJsonDocument(contact).toJson(QJsonDocument::Compact));
+	reply(socket, contact);
 }
 
-void Dispatcher::actionAuth(const QJsonObject &object, QWebSocket *socket)
+void Dispatcher::actionAuth(const QJsonObject &object, const SocketRef &socket)
 {
 	QJsonObject contact;
 	contact["action"] = static_cast<int>(Action::Auth);
@@ -120,38 +318,101 @@ void Dispatcher::actionAuth(const QJsonObject &object, QWebSocket *socket)
 		contact["update"] = true;
 		actionQueryData(contact);
 
-		if (object["id"].toInt() == 0)
-			clientService_.add(contact["id"].toInt(), contact["login"].toString(), socket);
-		else
-			clientService_.add(object["id"].toInt(), object["login"].toString(), socket);
+		// Pushes use CBOR when the client authorized over a binary frame or asked for it
+		Protocol protocol = socket.protocol();
+		if (object["protocol"].toInt() == static_cast<int>(Protocol::Cbor))
+			protocol = Protocol::Cbor;
+
+		// Clients that can't decompress don't send the key
+		Compression compression = negotiateCompression(object["compression"].toInt());
+		contact["compression"] = static_cast<int>(compression);
+
+		// The session is the account whose password was checked, never an id from the request
+		int id = contact["id"].toInt();
+		QString login = contact["login"].toString();
+		attach(socket, id, login, protocol, compression);
+
+		// Reconnects resume with the token instead of a full login
+		qint64 expires = 0;
+		contact["token"] = GetSessionTokens()->issue(id, login, &expires);
+		contact["tokenExpires"] = expires;
+
+		// The auth reply is the largest one, it is compressed already
+		reply(SocketRef(socket, socket.protocol(), compression), contact);
+		return;
 	}
 
-	socket->sendTextMessage(QJsonDocument(contact).toJson(QJsonDocument::Compact));
+	reply(socket, contact);
 }
 
-void Dispatcher::actionQueryData(QJsonObject& contact)
+void Dispatcher::actionResume(const QJsonObject &object, const SocketRef &socket)
 {
-	GetDatabase()->queryContact(contact, contact["login"].toString());
+	QJsonObject root;
+	root["action"] = static_cast<int>(Action::Resume);
 
-	// Query link contacts
-	QJsonArray links;
-	IntList rids = GetDatabase()->queryLinks(contact["id"].toInt());
-	for (int rid : rids)
+	// The token is checked without the database, an invalid one means a full Auth
+	int id = 0;
+	QString login;
+	if (!GetSessionTokens()->verify(object["token"].toString(), id, login))
 	{
-		QJsonObject linkContact;
-		if (GetDatabase()->queryContact(linkContact, rid))
-			links.push_back(linkContact);
+		root["code"] = static_cast<int>(ErrorCode::Token);
+		reply(socket, root);
+		return;
 	}
 
-	contact["links"] = links;
+	Protocol protocol = socket.protocol();
+	if (object["protocol"].toInt() == static_cast<int>(Protocol::Cbor))
+		protocol = Protocol::Cbor;
+
+	// Before the attach, which makes this socket one of the contact's devices
+	bool alone = !shards_.online(id);
+
+	Compression compression = negotiateCompression(object["compression"].toInt());
+	attach(socket, id, login, protocol, compression);
+
+	qint64 expires = 0;
+	root["code"] = static_cast<int>(ErrorCode::Ok);
+	root["id"] = id;
+	root["login"] = login;
+	root["compression"] = static_cast<int>(compression);
+	root["token"] = GetSessionTokens()->issue(id, login, &expires);
+	root["tokenExpires"] = expires;
+
+	SocketRef ref(socket, socket.protocol(), compression);
+	reply(ref, root);
+
+	// The client catches up from the last seq it acknowledged, not from the delivery cursor,
+	// so frames lost with the old connection come again. The rest is paged with Sync.
+	// As at auth: with no other device waiting for pushes, everything up to the current seq is
+	// the client's to sync, a later notify must not push it again. Taken before the page, so a
+	// concurrent write is pushed rather than missed.
+	qint64 seq = GetDatabase()->queryHistorySeq();
+	qint64 since = qMax<qint64>(object["seq"].toVariant().toLongLong(), 0);
+	reply(ref, syncPage(id, 0, since, GetSettings()->params()["historyPageLimit"].toInt()));
+	if (alone)
+		GetDatabase()->setDeliveredSeq(id, seq);
+}
 
-	// Query history
-	QVariantMap options;
-	options["all"] = true;
-	options["cid"] = contact["id"].toInt();
+void Dispatcher::actionQueryData(QJsonObject& contact)
+{
+	// Contact with its linked contacts
+	GetDatabase()->queryContact(contact, contact["login"].toString());
+
+	// Query the latest messages of every conversation, older ones are paged with QueryHistory
+	int headSize = GetSettings()->params()["historyHeadSize"].toInt();
+	contact["historyPage"] = headSize;
+
+	// Sync cursor, taken before the heads so a concurrent write is synced again rather than missed
+	qint64 seq = GetDatabase()->queryHistorySeq();
+	contact["seq"] = seq;
+
+	// Unread count of every conversation from its read cursor
+	QJsonArray unread;
+	if (GetDatabase()->queryUnread(unread, contact["id"].toInt()))
+		contact["unread"] = unread;
 
 	VariantMapList historyList;
-	if (GetDatabase()->queryHistory(historyList, options))
+	if (GetDatabase()->queryHistoryHeads(historyList, contact["id"].toInt(), headSize))
 	{
 		QJsonObject root;
 		QJsonArray historyArray;
@@ -162,14 +423,119 @@ void Dispatcher::actionQueryData(QJsonObject& contact)
 		}
 
 		contact["history"] = historyArray;
-		GetDatabase()->setReadHistory(contact["id"].toInt());
 	}
 
+	// The delivery cursor is per contact. With other devices online, pending pushes they have
+	// not received yet must stay pending, this device catches up with Sync from "seq" instead.
+	// Without them nobody is waiting for the pushes, the client starts from "seq".
+	if (!shards_.online(contact["id"].toInt()))
+		GetDatabase()->setDeliveredSeq(contact["id"].toInt(), seq);
+
 	LOG("Query data, contact: " << contact["id"].toInt() << ", " << contact["login"].toString().toStdString());
 }
 
-void Dispatcher::actionSearch(const QJsonObject &object, QWebSocket *socket)
+void Dispatcher::actionQueryHistory(const QJsonObject &object, const SocketRef &socket)
+{
+	ClientPtr client = authorized(socket, Action::QueryHistory);
+	if (client == nullptr)
+		return;
+
+	int maxLimit = GetSettings()->params()["historyPageLimit"].toInt();
+	int limit = object["limit"].toInt(maxLimit);
+	if (limit <= 0 || limit > maxLimit)
+		limit = maxLimit;
+
+	// Fetch one extra row to tell the client whether there is more
+	VariantMapList historyList;
+	GetDatabase()->queryHistoryPage(historyList, client->id(), object["rid"].toInt(),
+									object["before"].toInt(), object["after"].toInt(), limit + 1);
+
+	bool more = historyList.size() > limit;
+	if (more)
+		historyList.removeLast();
+
+	QJsonArray historyArray;
+	for (const QVariantMap &data : historyList)
+		historyArray.push_back(QJsonObject::fromVariantMap(data));
+
+	QJsonObject root;
+	root["action"] = static_cast<int>(Action::QueryHistory);
+	root["rid"] = object["rid"].toInt();
+	root["history"] = historyArray;
+	root["more"] = more;
+	reply(socket, root);
+}
+
+void Dispatcher::actionSync(const QJsonObject &object, const SocketRef &socket)
 {
+	ClientPtr client = authorized(socket, Action::Sync);
+	if (client == nullptr)
+		return;
+
+	int maxLimit = GetSettings()->params()["historyPageLimit"].toInt();
+	int limit = object["limit"].toInt(maxLimit);
+	if (limit <= 0 || limit > maxLimit)
+		limit = maxLimit;
+
+	qint64 since = qMax<qint64>(object["since"].toVariant().toLongLong(), 0);
+	reply(socket, syncPage(client->id(), object["rid"].toInt(), since, limit));
+}
+
+QJsonObject Dispatcher::syncPage(int cid, int rid, qint64 since, int limit)
+{
+	// Changes after the client's cursor: new messages, edits and removals in sequence order.
+	// The client repeats with the returned "seq" while "more" is set.
+	VariantMapList historyList;
+	GetDatabase()->syncHistory(historyList, cid, rid, since, limit + 1);
+
+	bool more = historyList.size() > limit;
+	if (more)
+		historyList.removeLast();
+
+	QJsonArray historyArray;
+	for (const QVariantMap &data : historyList)
+		historyArray.push_back(QJsonObject::fromVariantMap(data));
+
+	QJsonObject root;
+	root["action"] = static_cast<int>(Action::Sync);
+	root["cid"] = cid;
+	root["rid"] = rid;
+	root["history"] = historyArray;
+	root["seq"] = historyList.isEmpty() ? since : historyList.last()["seq"].toLongLong();
+	root["more"] = more;
+	return root;
+}
+
+void Dispatcher::actionReadHistory(const QJsonObject &object, const SocketRef &socket)
+{
+	ClientPtr client = authorized(socket, Action::ReadHistory);
+	if (client == nullptr)
+		return;
+
+	// Read acknowledgement: the reader has read the conversation with rid up to hid
+	int cid = client->id();
+	int rid = object["rid"].toInt();
+	int hid = object["hid"].toInt();
+	bool ok = cid > 0 && rid > 0 && GetDatabase()->setReadCursor(cid, rid, hid);
+	if (!ok)
+		LOGW("Can't set read cursor! cid: " << cid << ", rid: " << rid << ", hid: " << hid);
+
+	QJsonObject root;
+	root["action"] = static_cast<int>(Action::ReadHistory);
+	root["code"] = static_cast<int>(ok ? ErrorCode::Ok : ErrorCode::Error);
+	root["rid"] = rid;
+	root["hid"] = hid;
+	reply(socket, root);
+}
+
+void Dispatcher::actionSearch(const QJsonObject &object, const SocketRef &socket)
+{
+	if (static_cast<SearchType>(object["type"].toInt()) == SearchType::History)
+	{
+		actionSearchHistory(object, socket);
+		return;
+	}
+
 	QJsonObject root;
 	if (!GetDatabase()->searchContacts(root, object["text"].toString(), object["cid"].toInt()))
 		root["searchResult"] = static_cast<int>(SearchResult::NotFound);
@@ -177,14 +543,144 @@ void Dispatcher::actionSearch(const QJsonObject &object, QWebSocket *socket)
 		root["searchResult"] = static_cast<int>(SearchResult::Found);
 
 	root["action"] = static_cast<int>(Action::Search);
-	socket->sendTextMessage(QJsonDocument(root).toJson(QJsonDocument::Compact));
+	reply(socket, root);
+}
+
+void Dispatcher::actionSearchHistory(const QJsonObject &object, const SocketRef &socket)
+{
+	ClientPtr client = authorized(socket, Action::Search);
+	if (client == nullptr)
+		return;
+
+	int maxLimit = GetSettings()->params()["historyPageLimit"].toInt();
+	int limit = object["limit"].toInt(maxLimit);
+	if (limit <= 0 || limit > maxLimit)
+		limit = maxLimit;
+
+	int offset = qMax(object["offset"].toInt(), 0);
+
+	// Ranked best match first, only in conversations of the requester
+	VariantMapList historyList;
+	bool found = GetDatabase()->searchHistory(historyList, object["text"].toString(), client->id(),
+											  limit + 1, offset);
+
+	bool more = historyList.size() > limit;
+	if (more)
+		historyList.removeLast();
+
+	QJsonArray historyArray;
+	for (const QVariantMap &data : historyList)
+		historyArray.push_back(QJsonObject::fromVariantMap(data));
+
+	QJsonObject root;
+	root["action"] = static_cast<int>(Action::Search);
+	root["type"] = static_cast<int>(SearchType::History);
+	root["searchResult"] = static_cast<int>(found ? SearchResult::Found : SearchResult::NotFound);
+	root["history"] = historyArray;
+	root["offset"] = offset;
+	root["more"] = more;
+	reply(socket, root);
 }
 
-void Dispatcher::actionMessage(const QJsonObject &object, QWebSocket *socket)
+void Dispatcher::actionQueryAvatar(const QJsonObject &object, const SocketRef &socket)
 {
+	// Avatars never change under a hash, clients cache them by it
+	QString hash = object["avatar"].toString();
+	AvatarPtr avatar = AvatarStore::isHash(hash) ? GetAvatarStore()->get(hash) : nullptr;
+	ErrorCode code = avatar != nullptr ? ErrorCode::Ok : ErrorCode::Error;
+
+	int64_t start = steady_micro();
+	QByteArray data;
+	if (socket.protocol() == Protocol::Cbor)
+	{
+		// Raw bytes in a binary frame, straight from the mapping
+		actionStats(Action::QueryAvatar).sent->add();
+		QCborMap root;
+		root[QLatin1String("action")] = static_cast<int>(Action::QueryAvatar);
+		root[QLatin1String("code")] = static_cast<int>(code);
+		root[QLatin1String("avatar")] = hash;
+		if (avatar != nullptr)
+			root[QLatin1String("image")] = avatar->data();
+		data = root.toCborValue().toCbor();
+	}
+	else
+	{
+		QJsonObject root;
+		root["action"] = static_cast<int>(Action::QueryAvatar);
+		root["code"] = static_cast<int>(code);
+		root["avatar"] = hash;
+		if (avatar != nullptr)
+			root["image"] = QString::fromLatin1(avatar->data().toBase64());
+		data = encodeMessage(root, Protocol::Json, socket.compression());
+	}
+	Metrics::phases().serialize += steady_micro() - start;
+
+	if (avatar == nullptr)
+		++Metrics::phases().errors;
+
+	replyData(socket, data);
 }
 
-void Dispatcher::actionLinkContact(const QJsonObject& object, QWebSocket* socket)
+void Dispatcher::actionMessage(const QJsonObject &object, const SocketRef &socket)
+{
+	// Persist first, then relay the stored row to every online device of the recipient.
+	// It carries the server id and seq, like the same message from Sync, QueryHistory or a push.
+	// A message to an online recipient is stored read, so the push thread does not send it again.
+	// Offline recipients get it from the stored history on their next auth.
+	ClientPtr client = authorized(socket, Action::Message);
+	if (client == nullptr)
+		return;
+
+	// Sent as the session's contact, whatever the request says
+	QJsonObject message = object;
+	message["cid"] = client->id();
+
+	int rid = object["rid"].toInt();
+	bool online = shards_.online(rid);
+
+	int hid = object["hid"].toInt();
+	int cid = client->id();
+	writer_.append(message, [this, socket, hid, cid, rid, online](bool stored, const QVariantMap &record) {
+		bool relayed = false;
+		if (!stored)
+			LOGW("Can't store message! cid: " << cid << ", rid: " << rid);
+		else if (online)
+		{
+			QJsonObject root;
+			root["action"] = static_cast<int>(Action::NewHistory);
+			root["history"] = QJsonArray({ QJsonObject::fromVariantMap(record) });
+			ClientList recipients = clientService_.findAll(rid);
+			for (const ClientPtr &recipient : recipients)
+				send(recipient, root);
+
+			// Devices connected to the other shards
+			relayed = shards_.deliver(rid, root, true) || !recipients.isEmpty();
+
+			// The recipient left before the commit, the row must not stay marked relayed
+			if (!relayed)
+				GetDatabase()->setRelayed(record["hid"].toInt(), false);
+		}
+
+		if (stored && !relayed)
+			shards_.notify(rid, HistoryState::Regular);
+
+		// The sender is acknowledged once the message is durable, with its server id
+		QJsonObject root;
+		root["action"] = static_cast<int>(Action::Message);
+		root["code"] = static_cast<int>(stored ? ErrorCode::Ok : ErrorCode::Error);
+		root["hid"] = hid;
+		root["rid"] = rid;
+		root["delivered"] = relayed;
+		if (stored)
+		{
+			root["id"] = record["hid"].toInt();
+			root["seq"] = record["seq"].toLongLong();
+		}
+		reply(socket, root);
+	}, online);
+}
+
+void Dispatcher::actionLinkContact(const QJsonObject& object, const SocketRef &socket)
 {
 	if (GetDatabase()->linkExists(object))
 	{
@@ -196,13 +692,13 @@ void Dispatcher::actionLinkContact(const QJsonObject& object, QWebSocket* socket
 		LOGW("Can't link contact!");
 }
 
-void Dispatcher::actionUnlinkContact(const QJsonObject& object, QWebSocket* socket)
+void Dispatcher::actionUnlinkContact(const QJsonObject& object, const SocketRef &socket)
 {
 	if (!GetDatabase()->unlinkContact(object))
 		LOGW("Can't link contact!");
 }
 
-void Dispatcher::actionQueryContact(const QJsonObject& object, QWebSocket* socket)
+void Dispatcher::actionQueryContact(const QJsonObject& object, const SocketRef &socket)
 {
 	QJsonObject contact;
 	if (!GetDatabase()->queryContact(contact, object["id"].toInt()))
@@ -214,62 +710,136 @@ void Dispatcher::actionQueryContact(const QJsonObject& object, QWebSocket* socke
 	QJsonObject root;
 	root["contact"] = contact;
 	root["action"] = static_cast<int>(Action::QueryContact);
-	socket->sendTextMessage(QJsonDocument(root).toJson(QJsonDocument::Compact));
+	reply(socket, root);
 }
 
-void Dispatcher::actionAddHistory(const QJsonObject& object, QWebSocket* socket)
+void Dispatcher::actionAddHistory(const QJsonObject& object, const SocketRef &socket)
 {
-	if (!GetDatabase()->appendHistory(object))
-		LOGW("Can't append history!");
+	int rid = object["rid"].toInt();
+	writer_.post(HistoryWriter::Operation::Append, object, [this, rid](bool ok) {
+		if (!ok)
+			LOGW("Can't append history!");
+		else
+			shards_.notify(rid, HistoryState::Regular);
+	});
 }
 
-void Dispatcher::actionModifyHistory(const QJsonObject& object, QWebSocket* socket)
+void Dispatcher::actionAddHistoryBatch(const QJsonObject &object, const SocketRef &socket)
 {
-	if (!GetDatabase()->modifyHistory(object))
-		LOGW("Can't modify history!");
+	ClientPtr client = authorized(socket, Action::AddHistoryBatch);
+	if (client == nullptr)
+		return;
+
+	QJsonObject root;
+	root["action"] = static_cast<int>(Action::AddHistoryBatch);
+
+	QJsonArray array = object["history"].toArray();
+	if (array.size() > GetSettings()->params()["historyBatchLimit"].toInt())
+	{
+		LOGW("History batch is too large: " << array.size());
+		root["code"] = static_cast<int>(ErrorCode::Error);
+		reply(socket, root);
+		return;
+	}
+
+	if (array.isEmpty())
+	{
+		root["results"] = QJsonArray();
+		reply(socket, root);
+		return;
+	}
+
+	// Rows are written as the session's contact, whatever the request says
+	for (int i = 0; i < array.size(); ++i)
+	{
+		QJsonObject history = array[i].toObject();
+		history["cid"] = client->id();
+		array[i] = history;
+	}
+
+	// One writer entry, so the batch commits in one group and keeps its place among the
+	// other writes of the connection
+	writer_.appendBatch(array, [this, socket, array, root](const QList<bool> &results) mutable {
+		QSet<int> recipients;
+		QJsonArray resultArray;
+		for (int i = 0; i < array.size(); ++i)
+		{
+			QJsonObject history = array[i].toObject();
+			bool ok = i < results.size() && results[i];
+
+			QJsonObject result;
+			result["hid"] = history["hid"].toInt();
+			result["code"] = static_cast<int>(ok ? ErrorCode::Ok : ErrorCode::Error);
+			resultArray.push_back(result);
+
+			if (ok)
+				recipients.insert(history["rid"].toInt());
+		}
+
+		for (int rid : recipients)
+			shards_.notify(rid, HistoryState::Regular);
+
+		root["results"] = resultArray;
+		reply(socket, root);
+	});
 }
 
-void Dispatcher::actionRemoveHistory(const QJsonObject& object, QWebSocket* socket)
+void Dispatcher::actionModifyHistory(const QJsonObject& object, const SocketRef &socket)
 {
-	if (!GetDatabase()->modifyRemoveHistory(object))
-		LOGW("Can't remove history!");
+	int rid = object["rid"].toInt();
+	writer_.post(HistoryWriter::Operation::Modify, object, [this, rid](bool ok) {
+		if (!ok)
+			LOGW("Can't modify history!");
+		else
+			shards_.notify(rid, HistoryState::Modified);
+	});
 }
 
-void Dispatcher::actionClearHistory(const QJsonObject& object, QWebSocket* socket)
+void Dispatcher::actionRemoveHistory(const QJsonObject& object, const SocketRef &socket)
 {
-	if (!GetDatabase()->clearHistory(object["cid"].toInt()))
-		LOGW("Can't clear history!");
+	int rid = object["rid"].toInt();
+	writer_.post(HistoryWriter::Operation::Remove, object, [this, rid](bool ok) {
+		if (!ok)
+			LOGW("Can't remove history!");
+		else
+			shards_.notify(rid, HistoryState::Removed);
+	});
+}
 
-	ClientPtr client = clientService_.find(object["cid"].toInt());
-	if (client == nullptr)
-		return;
+void Dispatcher::actionClearHistory(const QJsonObject& object, const SocketRef &socket)
+{
+	// Queued behind the earlier writes of the connection, so none of them brings a cleared message back
+	int cid = object["cid"].toInt();
+	writer_.post(HistoryWriter::Operation::Clear, object, [this, cid](bool ok) {
+		if (!ok)
+		{
+			LOGW("Can't clear history!");
+			return;
+		}
 
-	QJsonObject root;
-	root["action"] = static_cast<int>(Action::ClearHistory);
-	root["cid"] = object["cid"].toInt();
-	client->socket()->sendTextMessage(QJsonDocument(root).toJson(QJsonDocument::Compact));
+		QJsonObject root;
+		root["action"] = static_cast<int>(Action::ClearHistory);
+		root["cid"] = cid;
+		shards_.deliver(cid, root, true);
+
+		for (const ClientPtr &client : clientService_.findAll(cid))
+			send(client, root);
+	});
 }
 
-void Dispatcher::logMessage(const QString &message)
+void Dispatcher::logMessage(const QByteArray &data, const QJsonObject &object, Protocol protocol)
 {
-	if (!message.contains("\"image\""))
+	if (protocol == Protocol::Json && !object.contains("image") && !object.contains("token"))
 	{
-		LOG("Message received: " << message.toStdString());
+		LOG("Message received: " << data.toStdString());
 		return;
 	}
 
-	QJsonParseError error;
-	QJsonDocument document = QJsonDocument::fromJson(message.toUtf8(), &error);
-	if (error.error != QJsonParseError::NoError)
-	{
-		LOGE(error.errorString().toStdString());
-		return;
-	}
-
-	QJsonObject rootObject = document.object();
-
+	QJsonObject rootObject = object;
 	if (rootObject["image"].isString())
 		rootObject["image"] = "base64";
+	if (rootObject.contains("token"))
+		rootObject["token"] = "***";
 
 	LOG("Message received: " <<
 		QJsonDocument(rootObject).toJson(QJsonDocument::Compact).toStdString());
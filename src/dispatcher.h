@@ -3,8 +3,14 @@
 
 #include "server.h"
 #include "client.h"
+#include "workerpool.h"
+#include "metrics.h"
+#include "historywriter.h"
+#include "outbound.h"
+#include "shards.h"
 
 #include <QObject>
+#include <QTimer>
 
 class Dispatcher : public QObject
 {
@@ -25,7 +31,13 @@ public:
 		ModifyHistory,
 		RemoveHistory,
 		ClearHistory,
-		NewHistory
+		NewHistory,
+		QueryHistory,
+		AddHistoryBatch,
+		QueryAvatar,
+		Resume,
+		Sync,
+		ReadHistory
 	};
 
 	enum class ErrorCode
@@ -34,7 +46,9 @@ public:
 		Error,
 		LoginExists,
 		NoLogin,
-		Password
+		Password,
+		Token,
+		Unauthorized
 	};
 
 	enum class SearchResult
@@ -43,9 +57,20 @@ public:
 		NotFound
 	};
 
+	enum class SearchType
+	{
+		Contacts,
+		History
+	};
+
 private:
 	Server server_;
 	ClientService clientService_;
+	WorkerPool workers_;
+	HistoryWriter writer_;
+	Outbound outbound_;
+	Shards shards_;
+	QTimer metricsTimer_;
 
 public:
 	Dispatcher();
@@ -53,30 +78,52 @@ public:
 
 private slots:
 	void processMessage(const QString &message, QWebSocket *socket);
-	void sendMessage(const QString &message, const Client &client);
+	void processBinaryMessage(const QByteArray &message, QWebSocket *socket);
+	void sendMessage(const QByteArray &message, const Client &client);
 
 public:
 	bool start();
 	void stop();
 	ClientService& clientService() { return clientService_; }
+	Outbound& outbound() { return outbound_; }
+	Shards& shards() { return shards_; }
+	static const char *actionName(Action action);
+	static const ActionStats &actionStats(Action action);
 
 private:
-	void actionRegistration(QJsonObject &object, QWebSocket *socket);
-	void actionAuth(const QJsonObject &object, QWebSocket *socket);
-	void actionSearch(const QJsonObject &object, QWebSocket *socket);
-	void actionMessage(const QJsonObject &object, QWebSocket *socket);
-	void actionLinkContact(const QJsonObject &object, QWebSocket *socket);
-	void actionUnlinkContact(const QJsonObject &object, QWebSocket *socket);
-	void actionQueryContact(const QJsonObject &object, QWebSocket *socket);
+	void execute(const QByteArray &data, const SocketRef &socket);
+	static void countReceived(qint64 size);
+	Compression compression(QWebSocket *socket) const;
+	void reply(const SocketRef &socket, const QJsonObject &object);
+	void replyData(const SocketRef &socket, const QByteArray &data);
+	void send(const ClientPtr &client, const QJsonObject &object);
+	void attach(const SocketRef &socket, int id, const QString &login, Protocol protocol, Compression compression);
+	ClientPtr authorized(const SocketRef &socket, Action action);
+	static QJsonObject syncPage(int cid, int rid, qint64 since, int limit);
+
+	void actionRegistration(QJsonObject &object, const SocketRef &socket);
+	void actionAuth(const QJsonObject &object, const SocketRef &socket);
+	void actionResume(const QJsonObject &object, const SocketRef &socket);
+	void actionSearch(const QJsonObject &object, const SocketRef &socket);
+	void actionSearchHistory(const QJsonObject &object, const SocketRef &socket);
+	void actionMessage(const QJsonObject &object, const SocketRef &socket);
+	void actionLinkContact(const QJsonObject &object, const SocketRef &socket);
+	void actionUnlinkContact(const QJsonObject &object, const SocketRef &socket);
+	void actionQueryContact(const QJsonObject &object, const SocketRef &socket);
+	void actionQueryAvatar(const QJsonObject &object, const SocketRef &socket);
 
 	void actionQueryData(QJsonObject &contact);
-	void actionAddHistory(const QJsonObject &object, QWebSocket *socket);
-	void actionModifyHistory(const QJsonObject &object, QWebSocket *socket);
-	void actionRemoveHistory(const QJsonObject &object, QWebSocket *socket);
-	void actionClearHistory(const QJsonObject &object, QWebSocket *socket);
+	void actionAddHistory(const QJsonObject &object, const SocketRef &socket);
+	void actionAddHistoryBatch(const QJsonObject &object, const SocketRef &socket);
+	void actionModifyHistory(const QJsonObject &object, const SocketRef &socket);
+	void actionRemoveHistory(const QJsonObject &object, const SocketRef &socket);
+	void actionClearHistory(const QJsonObject &object, const SocketRef &socket);
+	void actionQueryHistory(const QJsonObject &object, const SocketRef &socket);
+	void actionSync(const QJsonObject &object, const SocketRef &socket);
+	void actionReadHistory(const QJsonObject &object, const SocketRef &socket);
 
 private:
-	void logMessage(const QString &message);
+	void logMessage(const QByteArray &data, const QJsonObject &object, Protocol protocol);
 };
 
 using DispatcherPtr = QSharedPointer<Dispatcher>;
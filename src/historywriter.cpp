@@ -0,0 +1,210 @@
+#include "historywriter.h"
+#include "database.h"
+#include "settings.h"
+#include "metrics.h"
+#include "common.h"
+#include "log.h"
+
+HistoryWriter::HistoryWriter()
+	: active_(false)
+	, thread_(nullptr)
+	, capacity_(0)
+	, batchSize_(0)
+	, batchDelay_(0)
+{
+}
+
+HistoryWriter::~HistoryWriter()
+{
+	stop();
+}
+
+void HistoryWriter::start()
+{
+	QVariantMap &params = GetSettings()->params();
+	capacity_ = qMax(params["historyWriteQueue"].toInt(), 1);
+	batchSize_ = qMax(params["historyWriteBatch"].toInt(), 1);
+	batchDelay_ = qMax(params["historyWriteDelay"].toInt(), 0);
+
+	active_ = true;
+	thread_ = QThread::create([this]() { run(); });
+	thread_->setObjectName("history-writer");
+	thread_->start();
+}
+
+void HistoryWriter::stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		active_ = false;
+	}
+
+	// Queued writes are committed before the thread exits
+	notEmpty_.notify_all();
+	notFull_.notify_all();
+	if (thread_)
+	{
+		thread_->wait();
+		delete thread_;
+		thread_ = nullptr;
+	}
+}
+
+size_t HistoryWriter::depth()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	return queue_.size();
+}
+
+void HistoryWriter::post(Operation operation, const QJsonObject &object, const Callback &done, bool read)
+{
+	Entry entry;
+	entry.operation = operation;
+	entry.object = object;
+	entry.read = read;
+	entry.done = done;
+	if (!enqueue(std::move(entry)) && done)
+		done(false);
+}
+
+void HistoryWriter::append(const QJsonObject &object, const RecordCallback &stored, bool read)
+{
+	Entry entry;
+	entry.object = object;
+	entry.read = read;
+	entry.stored = stored;
+	if (!enqueue(std::move(entry)) && stored)
+		stored(false, QVariantMap());
+}
+
+void HistoryWriter::appendBatch(const QJsonArray &history, const BatchCallback &done)
+{
+	Entry entry;
+	entry.operation = Operation::AppendBatch;
+	entry.object["history"] = history;
+	entry.batchDone = done;
+	if (!enqueue(std::move(entry)) && done)
+	{
+		QList<bool> results;
+		results.fill(false, history.size());
+		done(results);
+	}
+}
+
+bool HistoryWriter::enqueue(Entry &&entry)
+{
+	static Counter &blocked = GetMetrics()->counter("historyWriter.blocked");
+	static Histogram &wait = GetMetrics()->histogram("historyWriter.blockedTime");
+
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		if (active_ && queue_.size() >= capacity_)
+		{
+			blocked.add();
+			ScopedTimer timer(wait);
+			notFull_.wait(lock, [this]() { return !active_ || queue_.size() < capacity_; });
+		}
+
+		if (active_)
+		{
+			queue_.push_back(std::move(entry));
+			if (queue_.size() == 1 || queue_.size() >= batchSize_)
+				notEmpty_.notify_one();
+			return true;
+		}
+	}
+
+	// Stopped, nothing will commit the write
+	LOGW("History writer is stopped!");
+	return false;
+}
+
+std::future<bool> HistoryWriter::submit(Operation operation, const QJsonObject &object, bool read)
+{
+	std::shared_ptr<std::promise<bool>> promise = std::make_shared<std::promise<bool>>();
+	post(operation, object, [promise](bool ok) { promise->set_value(ok); }, read);
+	return promise->get_future();
+}
+
+void HistoryWriter::run()
+{
+	static Histogram &depth = GetMetrics()->histogram("historyWriter.queueDepth");
+
+	while (true)
+	{
+		std::deque<Entry> batch;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			notEmpty_.wait(lock, [this]() { return !active_ || !queue_.empty(); });
+			if (!active_ && queue_.empty())
+				break;
+
+			// Let the group fill up until its latency window closes
+			if (active_ && queue_.size() < batchSize_ && batchDelay_ > 0)
+				notEmpty_.wait_for(lock, std::chrono::milliseconds(batchDelay_),
+								   [this]() { return !active_ || queue_.size() >= batchSize_; });
+
+			depth.record(static_cast<int64_t>(queue_.size()));
+			size_t count = qMin(queue_.size(), batchSize_);
+			batch.insert(batch.end(), std::make_move_iterator(queue_.begin()),
+						 std::make_move_iterator(queue_.begin() + count));
+			queue_.erase(queue_.begin(), queue_.begin() + count);
+		}
+
+		notFull_.notify_all();
+		commit(batch);
+	}
+
+	GetDatabase()->close();
+}
+
+void HistoryWriter::commit(std::deque<Entry> &batch)
+{
+	static Histogram &batchSize = GetMetrics()->histogram("historyWriter.batchSize");
+	static Histogram &commitTime = GetMetrics()->histogram("historyWriter.commitTime");
+	static Counter &errors = GetMetrics()->counter("historyWriter.errors");
+
+	int64_t start = steady_micro();
+	DatabasePtr database = GetDatabase();
+	bool transaction = database->beginTransaction();
+
+	// A failed statement does not abort the transaction, the other writes of the group still commit
+	QList<bool> results;
+	for (Entry &entry : batch)
+	{
+		if (entry.operation == Operation::Append)
+			results.push_back(database->appendHistory(entry.object, entry.read, entry.stored ? &entry.record : nullptr));
+		else if (entry.operation == Operation::Modify)
+			results.push_back(database->modifyHistory(entry.object));
+		else if (entry.operation == Operation::Remove)
+			results.push_back(database->modifyRemoveHistory(entry.object));
+		else if (entry.operation == Operation::Clear)
+			results.push_back(database->clearHistory(entry.object["cid"].toInt()));
+		else
+			results.push_back(database->appendHistoryBatch(entry.object["history"].toArray(), entry.results));
+	}
+
+	if (transaction && !database->commitTransaction())
+	{
+		database->rollbackTransaction();
+		for (bool &result : results)
+			result = false;
+		for (Entry &entry : batch)
+			entry.results.fill(false);
+	}
+
+	batchSize.record(static_cast<int64_t>(batch.size()));
+	commitTime.record(steady_micro() - start);
+
+	for (size_t i = 0; i < batch.size(); ++i)
+	{
+		if (!results[i])
+			errors.add();
+		if (batch[i].done)
+			batch[i].done(results[i]);
+		if (batch[i].stored)
+			batch[i].stored(results[i], results[i] ? batch[i].record : QVariantMap());
+		if (batch[i].batchDone)
+			batch[i].batchDone(batch[i].results);
+	}
+}
@@ -0,0 +1,80 @@
+#ifndef HISTORYWRITER_H
+#define HISTORYWRITER_H
+
+#include <QJsonObject>
+#include <QVariantMap>
+#include <QJsonArray>
+#include <QList>
+#include <QThread>
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <condition_variable>
+
+// Write-behind stage for history mutations. Writes are queued and committed in
+// groups on one thread, a group is committed when it is full or when its first
+// write has waited "historyWriteDelay" ms. The callback of a write runs on the
+// writer thread after its group is committed. A full queue blocks the caller.
+class HistoryWriter
+{
+public:
+	enum class Operation
+	{
+		Append,
+		Modify,
+		Remove,
+		Clear, // Whole history of "cid"
+		AppendBatch // Rows of "history", one entry so they commit together
+	};
+
+	using Callback = std::function<void(bool ok)>;
+	using RecordCallback = std::function<void(bool ok, const QVariantMap &record)>; // Stored row of an append
+	using BatchCallback = std::function<void(const QList<bool> &results)>; // Result of every batch row
+
+private:
+	struct Entry
+	{
+		Operation operation = Operation::Append;
+		QJsonObject object;
+		bool read = false;
+		Callback done;
+		RecordCallback stored;
+		QVariantMap record;
+		BatchCallback batchDone;
+		QList<bool> results;
+	};
+
+	std::atomic_bool active_;
+	QThread *thread_;
+	std::mutex mutex_;
+	std::condition_variable notEmpty_;
+	std::condition_variable notFull_;
+	std::deque<Entry> queue_;
+	size_t capacity_;
+	size_t batchSize_;
+	int batchDelay_;
+
+public:
+	HistoryWriter();
+	~HistoryWriter();
+
+public:
+	void start();
+	void stop();
+	size_t depth();
+
+	void post(Operation operation, const QJsonObject &object, const Callback &done = nullptr, bool read = false);
+	std::future<bool> submit(Operation operation, const QJsonObject &object, bool read = false);
+	void append(const QJsonObject &object, const RecordCallback &stored, bool read = false);
+	void appendBatch(const QJsonArray &history, const BatchCallback &done);
+
+private:
+	bool enqueue(Entry &&entry);
+	void run();
+	void commit(std::deque<Entry> &batch);
+};
+
+#endif // HISTORYWRITER_H
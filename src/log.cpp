@@ -3,6 +3,7 @@
 #include "settings.h"
 
 #include <iostream>
+#include <cstdint>
 #include <ctime>
 #include <sys/time.h>
 
@@ -10,6 +11,15 @@ LoggerPtr Log::_instance = nullptr;
 
 Log::Log()
 	: _verb(Level::Debug)
+	, _console(&std::cout)
+	, _async(false)
+	, _mask(0)
+	, _head(0)
+	, _tail(0)
+	, _overflow(Overflow::Drop)
+	, _dropped(0)
+	, _flushInterval(100)
+	, _flushSize(0)
 {
 #ifdef WIN32
 	std::string logName = GetSettings()->logPath().toStdString() +
@@ -19,6 +29,11 @@ Log::Log()
 						  "/log-" + currentTime() + ".txt";
 #endif
 
+	// Shards start at the same second, each writes its own file
+	QVariantMap &params = GetSettings()->params();
+	if (params["shards"].toInt() > 1)
+		logName.insert(logName.size() - 4, "-" + params["shard"].toString().toStdString());
+
 	_stream.open(logName, std::ios_base::out | std::ios_base::trunc);
 	if (!_stream.is_open())
 		return;
@@ -28,6 +43,8 @@ Log::Log()
 
 Log::~Log()
 {
+	stopAsync();
+
 	if (_stream.is_open())
 	{
 		_stream << "[" << currentTimeMs() << "] " << "Quit"  << std::endl;
@@ -35,17 +52,180 @@ Log::~Log()
 	}
 }
 
+void Log::configure()
+{
+	QVariantMap &params = GetSettings()->params();
+	if (_instance == nullptr || !params["logAsync"].toBool())
+		return;
+
+	Overflow overflow = params["logOverflow"].toString() == "block" ? Overflow::Block : Overflow::Drop;
+	_instance->startAsync(params["logQueueSize"].toUInt(), overflow,
+						  params["logFlushInterval"].toInt(), params["logFlushSize"].toUInt());
+}
+
+void Log::startAsync(size_t capacity, Overflow overflow, int flushInterval, size_t flushSize)
+{
+	if (_async)
+		return;
+
+	// Round up to a power of two, so a position maps to a slot with a mask
+	size_t size = 2;
+	while (size < capacity)
+		size <<= 1;
+
+	_ring.reset(new Slot[size]);
+	for (size_t i = 0; i < size; ++i)
+		_ring[i].sequence.store(i, std::memory_order_relaxed);
+
+	_mask = size - 1;
+	_head = 0;
+	_tail = 0;
+	_overflow = overflow;
+	_flushInterval = std::chrono::milliseconds(flushInterval > 0 ? flushInterval : 1);
+	_flushSize = flushSize;
+	_async = true;
+	_thread = std::thread([this]() { run(); });
+}
+
+void Log::stopAsync()
+{
+	if (!_async)
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(_wakeMutex);
+		_async = false;
+	}
+
+	_wake.notify_one();
+	_thread.join();
+
+	// Lines pushed while the writer was stopping
+	std::string line;
+	while (pop(line))
+		writeLine(line);
+	_console->flush();
+	_stream.flush();
+
+	if (_dropped > 0)
+		_stream << "[" << currentTimeMs() << "] " << "Dropped log lines: " << _dropped << std::endl;
+}
+
 void Log::write(const std::string &text, Log::Level level)
 {
 	if (level > _verb)
 		return;
 
 	std::string line = createLine(text, level);
-	std::cout << line << std::endl;
-	_stream << line << std::endl;
+	if (_async && push(line))
+		return;
+
+	std::lock_guard<std::mutex> lock(_mutex);
+	writeLine(line);
+	_console->flush();
 	_stream.flush();
 }
 
+void Log::writeLine(const std::string &line)
+{
+	*_console << line << '\n';
+	_stream << line << '\n';
+}
+
+bool Log::push(std::string &line)
+{
+	size_t pos = _head.load(std::memory_order_relaxed);
+	while (true)
+	{
+		Slot &slot = _ring[pos & _mask];
+		size_t sequence = slot.sequence.load(std::memory_order_acquire);
+		intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+
+		if (diff == 0)
+		{
+			if (_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+			{
+				slot.line.swap(line);
+				slot.sequence.store(pos + 1, std::memory_order_release);
+
+				// The writer sleeps between flushes, wake it early when half full
+				if (pos + 1 - _tail.load(std::memory_order_relaxed) == (_mask + 1) / 2)
+					_wake.notify_one();
+				return true;
+			}
+		}
+		else if (diff < 0)
+		{
+			// Full
+			if (_overflow == Overflow::Drop)
+			{
+				++_dropped;
+				return true;
+			}
+
+			if (!_async)
+				return false;
+
+			_wake.notify_one();
+			std::this_thread::yield();
+			pos = _head.load(std::memory_order_relaxed);
+		}
+		else
+			pos = _head.load(std::memory_order_relaxed);
+	}
+}
+
+bool Log::pop(std::string &line)
+{
+	size_t pos = _tail.load(std::memory_order_relaxed);
+	Slot &slot = _ring[pos & _mask];
+	if (slot.sequence.load(std::memory_order_acquire) != pos + 1)
+		return false;
+
+	line.swap(slot.line);
+	slot.line.clear();
+	slot.sequence.store(pos + _mask + 1, std::memory_order_release);
+	_tail.store(pos + 1, std::memory_order_relaxed);
+	return true;
+}
+
+void Log::run()
+{
+	std::string batch;
+	std::string line;
+	auto lastFlush = std::chrono::steady_clock::now();
+
+	while (_async)
+	{
+		while (pop(line))
+		{
+			batch += line;
+			batch += '\n';
+			if (batch.size() >= _flushSize)
+				break;
+		}
+
+		auto now = std::chrono::steady_clock::now();
+		if (!batch.empty() && (batch.size() >= _flushSize || now - lastFlush >= _flushInterval))
+		{
+			// One large write per batch instead of a write and flush per line
+			_console->write(batch.data(), batch.size());
+			_console->flush();
+			_stream.write(batch.data(), batch.size());
+			_stream.flush();
+			batch.clear();
+			lastFlush = now;
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(_wakeMutex);
+		_wake.wait_for(lock, _flushInterval);
+	}
+
+	_console->write(batch.data(), batch.size());
+	_stream.write(batch.data(), batch.size());
+}
+
 std::string Log::createLine(const std::string &text, Log::Level level)
 {
 	std::string prefix = "";
@@ -5,6 +5,11 @@
 #include <string>
 #include <memory>
 #include <sstream>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
 
 #define LOG(...) { std::stringstream __stream; __stream << __VA_ARGS__; log(__stream.str()); }
 #define LOGW(...) { std::stringstream __stream; __stream << __VA_ARGS__; logw(__stream.str()); }
@@ -28,10 +33,41 @@ public:
 		Debug
 	};
 
+	// What an async producer does when the ring buffer is full
+	enum class Overflow
+	{
+		Drop,
+		Block
+	};
+
+private:
+	// Ring buffer cell, sequence tells whose turn it is (bounded MPSC queue)
+	struct Slot
+	{
+		std::atomic<size_t> sequence;
+		std::string line;
+	};
+
 private:
 	static LoggerPtr _instance;
 	Level _verb;
 	std::ofstream _stream;
+	std::ostream *_console; // Copy of every line, stdout by default
+	std::mutex _mutex;
+
+	// Async mode
+	std::atomic_bool _async;
+	std::unique_ptr<Slot[]> _ring;
+	size_t _mask;
+	std::atomic<size_t> _head;
+	std::atomic<size_t> _tail;
+	Overflow _overflow;
+	std::atomic<uint64_t> _dropped;
+	std::chrono::milliseconds _flushInterval;
+	size_t _flushSize;
+	std::thread _thread;
+	std::mutex _wakeMutex;
+	std::condition_variable _wake;
 
 public:
 	Log();
@@ -39,7 +75,12 @@ public:
 
 public:
 	void setVerb(Level level) { _verb = level; }
+	void setConsole(std::ostream &console) { _console = &console; }
 	void write(const std::string &text, Log::Level level = Log::Level::Info);
+	void startAsync(size_t capacity, Overflow overflow, int flushInterval, size_t flushSize);
+	void stopAsync();
+	size_t queueDepth() const { return _async ? _head - _tail : 0; }
+	uint64_t dropped() const { return _dropped; }
 
 	static LoggerPtr create()
 	{
@@ -64,8 +105,17 @@ public:
 		_instance->setVerb(level);
 	}
 
+	static LoggerPtr instance() { return _instance; }
+
+	// Applies log settings, call after the settings are loaded
+	static void configure();
+
 private:
 	std::string createLine(const std::string &text, Log::Level level);
+	void writeLine(const std::string &line);
+	bool push(std::string &line);
+	bool pop(std::string &line);
+	void run();
 };
 
 inline void log(const std::string &text, Log::Level level = Log::Level::Info) { Log::put(text, level); }
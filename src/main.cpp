@@ -1,4 +1,5 @@
 #include <QCoreApplication>
+#include <QCommandLineParser>
 #include "dispatcher.h"
 #include "settings.h"
 #include "log.h"
@@ -6,8 +7,22 @@
 int main(int argc, char *argv[])
 {
 	QCoreApplication a(argc, argv);
+
+	// Shard 0 is started by hand and starts the others with --shard
+	QCommandLineParser parser;
+	QCommandLineOption shardsOption("shards", "Server processes sharing the port.", "count");
+	QCommandLineOption shardOption("shard", "Index of this process (internal).", "index");
+	parser.addOptions({ shardsOption, shardOption });
+	parser.addHelpOption();
+	parser.process(a);
+	if (parser.isSet(shardsOption))
+		GetSettings()->params()["shards"] = parser.value(shardsOption).toInt();
+	if (parser.isSet(shardOption))
+		GetSettings()->params()["shard"] = parser.value(shardOption).toInt();
+
 	Log::create();
 	GetSettings()->load();
+	Log::configure();
 	if (!GetDispatcher()->start())
 		return -1;
 	LOG("WebSocket server started!");
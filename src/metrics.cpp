@@ -0,0 +1,313 @@
+#include "metrics.h"
+#include "common.h"
+#include "log.h"
+
+#include <QJsonDocument>
+#include <QtAlgorithms>
+
+#include <cctype>
+#include <cstring>
+
+Histogram::Histogram()
+	: count_(0)
+	, sum_(0)
+	, max_(0)
+{
+	for (std::atomic<uint64_t> &bucket : buckets_)
+		bucket.store(0, std::memory_order_relaxed);
+}
+
+int Histogram::bucketIndex(uint64_t value)
+{
+	if (value < static_cast<uint64_t>(kSubCount))
+		return static_cast<int>(value);
+
+	int msb = 63 - qCountLeadingZeroBits(static_cast<quint64>(value));
+	if (msb >= kMaxBits)
+		return kBucketCount - 1;
+
+	int shift = msb - kSubBits;
+	return (shift + 1) * kSubCount + static_cast<int>((value >> shift) - kSubCount);
+}
+
+uint64_t Histogram::bucketLowerBound(int index)
+{
+	if (index < kSubCount)
+		return index;
+
+	int shift = index / kSubCount - 1;
+	return static_cast<uint64_t>(index % kSubCount + kSubCount) << shift;
+}
+
+uint64_t Histogram::bucketUpperBound(int index)
+{
+	if (index < kSubCount)
+		return index;
+
+	int shift = index / kSubCount - 1;
+	return bucketLowerBound(index) + (static_cast<uint64_t>(1) << shift) - 1;
+}
+
+void Histogram::record(int64_t value)
+{
+	uint64_t sample = value > 0 ? static_cast<uint64_t>(value) : 0;
+	buckets_[bucketIndex(sample)].fetch_add(1, std::memory_order_relaxed);
+	count_.fetch_add(1, std::memory_order_relaxed);
+	sum_.fetch_add(sample, std::memory_order_relaxed);
+
+	uint64_t max = max_.load(std::memory_order_relaxed);
+	while (sample > max && !max_.compare_exchange_weak(max, sample, std::memory_order_relaxed));
+}
+
+int64_t Histogram::percentile(double percent) const
+{
+	uint64_t total = count();
+	if (total == 0)
+		return 0;
+
+	uint64_t rank = static_cast<uint64_t>(percent / 100.0 * total + 0.5);
+	if (rank == 0)
+		rank = 1;
+
+	uint64_t seen = 0;
+	for (int i = 0; i < kBucketCount; ++i)
+	{
+		seen += bucketCount(i);
+		if (seen >= rank)
+			return static_cast<int64_t>(qMin(bucketUpperBound(i), max()));
+	}
+
+	return static_cast<int64_t>(max());
+}
+
+QJsonObject Histogram::toJson() const
+{
+	QJsonObject object;
+	uint64_t total = count();
+	object["count"] = static_cast<qint64>(total);
+	object["mean"] = total > 0 ? static_cast<double>(sum()) / total : 0.0;
+	object["p50"] = static_cast<qint64>(percentile(50.0));
+	object["p99"] = static_cast<qint64>(percentile(99.0));
+	object["p999"] = static_cast<qint64>(percentile(99.9));
+	object["max"] = static_cast<qint64>(max());
+	return object;
+}
+
+Metrics::Metrics()
+{
+}
+
+Counter &Metrics::counter(const std::string &name)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	std::unique_ptr<Counter> &counter = counters_[name];
+	if (counter == nullptr)
+		counter.reset(new Counter());
+	return *counter;
+}
+
+Histogram &Metrics::histogram(const std::string &name)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	std::unique_ptr<Histogram> &histogram = histograms_[name];
+	if (histogram == nullptr)
+		histogram.reset(new Histogram());
+	return *histogram;
+}
+
+ActionStats Metrics::actionStats(const std::string &action)
+{
+	ActionStats stats;
+	stats.calls = &counter("action." + action + ".calls");
+	stats.errors = &counter("action." + action + ".errors");
+	stats.total = &histogram("action." + action + ".total");
+	stats.parse = &histogram("action." + action + ".parse");
+	stats.db = &histogram("action." + action + ".db");
+	stats.serialize = &histogram("action." + action + ".serialize");
+	stats.sent = &counter("action." + action + ".sent");
+	return stats;
+}
+
+void Metrics::gauge(const std::string &name, const Gauge &read)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	gauges_[name] = read;
+}
+
+QJsonObject Metrics::snapshot() const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	QJsonObject counters;
+	for (const auto &counter : counters_)
+		counters[QString::fromStdString(counter.first)] = static_cast<qint64>(counter.second->value());
+
+	QJsonObject histograms;
+	for (const auto &histogram : histograms_)
+	{
+		if (histogram.second->count() > 0)
+			histograms[QString::fromStdString(histogram.first)] = histogram.second->toJson();
+	}
+
+	QJsonObject gauges;
+	for (const auto &gauge : gauges_)
+		gauges[QString::fromStdString(gauge.first)] = gauge.second();
+
+	QJsonObject object;
+	object["counters"] = counters;
+	object["histograms"] = histograms;
+	object["gauges"] = gauges;
+	return object;
+}
+
+void Metrics::dump() const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	for (const auto &counter : counters_)
+	{
+		if (counter.second->value() > 0)
+			LOG("Metric " << counter.first << ": " << counter.second->value());
+	}
+
+	for (const auto &histogram : histograms_)
+	{
+		const Histogram &h = *histogram.second;
+		if (h.count() == 0)
+			continue;
+
+		LOG("Metric " << histogram.first << ", us: count " << h.count() << ", p50 " << h.percentile(50.0) <<
+			", p99 " << h.percentile(99.0) << ", p999 " << h.percentile(99.9) << ", max " << h.max());
+	}
+
+	for (const auto &gauge : gauges_)
+		LOG("Metric " << gauge.first << ": " << gauge.second());
+}
+
+namespace
+{
+
+// Families with a label: "action.Auth.calls" -> maty_action_calls{action="Auth"},
+// "db.queryHistory" -> maty_db{method="queryHistory"}. Other names map one to one.
+void prometheusName(const std::string &name, std::string &family, std::string &labels)
+{
+	static const std::pair<const char *, const char *> labelled[] = {
+		{ "action.", "action" },
+		{ "db.", "method" }
+	};
+
+	std::string metric = name;
+	labels.clear();
+	for (const auto &prefix : labelled)
+	{
+		size_t size = strlen(prefix.first);
+		if (name.compare(0, size, prefix.first) != 0)
+			continue;
+
+		std::string rest = name.substr(size);
+		size_t dot = rest.find('.');
+		std::string value = rest.substr(0, dot);
+		metric = std::string(prefix.first) + (dot == std::string::npos ? "" : rest.substr(dot + 1));
+		labels = std::string(prefix.second) + "=\"" + value + "\"";
+		break;
+	}
+
+	family = "maty_";
+	for (char c : metric)
+		family += isalnum(static_cast<unsigned char>(c)) ? c : '_';
+	while (family.back() == '_')
+		family.pop_back();
+}
+
+}
+
+QByteArray Metrics::prometheus() const
+{
+	// Text exposition format, one TYPE line per family
+	std::map<std::string, std::pair<const char *, std::string>> families;
+	auto add = [&families](const std::string &family, const char *type, const std::string &lines) {
+		std::pair<const char *, std::string> &entry = families[family];
+		entry.first = type;
+		entry.second += lines;
+	};
+
+	auto withLabels = [](const std::string &labels, const std::string &extra) {
+		std::string all = labels.empty() ? extra : (extra.empty() ? labels : labels + "," + extra);
+		return all.empty() ? std::string() : "{" + all + "}";
+	};
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	for (const auto &counter : counters_)
+	{
+		std::string family, labels;
+		prometheusName(counter.first, family, labels);
+		family += "_total";
+		add(family, "counter", family + withLabels(labels, "") + " " + std::to_string(counter.second->value()) + "\n");
+	}
+
+	for (const auto &histogram : histograms_)
+	{
+		const Histogram &h = *histogram.second;
+		std::string family, labels;
+		prometheusName(histogram.first, family, labels);
+		family += "_us";
+
+		std::string lines;
+		for (const auto &quantile : { std::make_pair("0.5", 50.0), std::make_pair("0.99", 99.0),
+									  std::make_pair("0.999", 99.9) })
+			lines += family + withLabels(labels, std::string("quantile=\"") + quantile.first + "\"") + " " +
+					 std::to_string(h.percentile(quantile.second)) + "\n";
+		lines += family + "_sum" + withLabels(labels, "") + " " + std::to_string(h.sum()) + "\n";
+		lines += family + "_count" + withLabels(labels, "") + " " + std::to_string(h.count()) + "\n";
+		add(family, "summary", lines);
+	}
+
+	for (const auto &gauge : gauges_)
+	{
+		std::string family, labels;
+		prometheusName(gauge.first, family, labels);
+		add(family, "gauge", family + withLabels(labels, "") + " " + std::to_string(gauge.second()) + "\n");
+	}
+
+	std::string text;
+	for (const auto &family : families)
+		text += "# TYPE " + family.first + " " + family.second.first + "\n" + family.second.second;
+
+	return QByteArray::fromStdString(text);
+}
+
+RequestPhases &Metrics::phases()
+{
+	static thread_local RequestPhases phases;
+	return phases;
+}
+
+ScopedTimer::ScopedTimer(Histogram &histogram, int64_t *accumulator)
+	: histogram_(histogram)
+	, accumulator_(accumulator)
+	, start_(steady_micro())
+{
+}
+
+ScopedTimer::~ScopedTimer()
+{
+	int64_t elapsed = steady_micro() - start_;
+	histogram_.record(elapsed);
+	if (accumulator_)
+		*accumulator_ += elapsed;
+}
+
+DbTimer::DbTimer(Histogram &histogram)
+	: histogram_(histogram)
+	, start_(steady_micro())
+{
+	++Metrics::phases().dbDepth;
+}
+
+DbTimer::~DbTimer()
+{
+	int64_t elapsed = steady_micro() - start_;
+	histogram_.record(elapsed);
+
+	RequestPhases &phases = Metrics::phases();
+	if (--phases.dbDepth == 0)
+		phases.db += elapsed;
+}
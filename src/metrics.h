@@ -0,0 +1,152 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <QSharedPointer>
+#include <QJsonObject>
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+// Monotonic event counter
+class Counter
+{
+private:
+	std::atomic<uint64_t> value_;
+
+public:
+	Counter() : value_(0) {}
+
+public:
+	void add(uint64_t value = 1) { value_.fetch_add(value, std::memory_order_relaxed); }
+	uint64_t value() const { return value_.load(std::memory_order_relaxed); }
+};
+
+// Latency histogram in microseconds with log-linear (HDR style) buckets:
+// every power of two is split into 16 sub-buckets, so a recorded value is
+// off by at most 1/16 of itself. Recording is lock free.
+class Histogram
+{
+public:
+	static constexpr int kSubBits = 4;
+	static constexpr int kSubCount = 1 << kSubBits;
+	static constexpr int kMaxBits = 40;
+	static constexpr int kBucketCount = (kMaxBits - kSubBits + 1) * kSubCount;
+
+private:
+	std::atomic<uint64_t> buckets_[kBucketCount];
+	std::atomic<uint64_t> count_;
+	std::atomic<uint64_t> sum_;
+	std::atomic<uint64_t> max_;
+
+public:
+	Histogram();
+
+public:
+	void record(int64_t value);
+	uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+	uint64_t sum() const { return sum_.load(std::memory_order_relaxed); }
+	uint64_t max() const { return max_.load(std::memory_order_relaxed); }
+	int64_t percentile(double percent) const;
+	QJsonObject toJson() const;
+
+	static int bucketIndex(uint64_t value);
+	static uint64_t bucketLowerBound(int index);
+	static uint64_t bucketUpperBound(int index);
+	uint64_t bucketCount(int index) const { return buckets_[index].load(std::memory_order_relaxed); }
+};
+
+// Metrics of one dispatcher action, split by request phase
+struct ActionStats
+{
+	Counter *calls;
+	Counter *errors;
+	Histogram *total;
+	Histogram *parse;
+	Histogram *db;
+	Histogram *serialize;
+	Counter *sent; // Messages of the action sent to clients
+};
+
+// Per-thread time and error accumulators of the request being executed
+struct RequestPhases
+{
+	int64_t db = 0;
+	int64_t serialize = 0;
+	int errors = 0;
+	int dbDepth = 0; // Nested Database calls count once
+};
+
+// Named counters, histograms and gauges registry
+class Metrics
+{
+	friend class QSharedPointer<Metrics>;
+
+public:
+	using Gauge = std::function<double()>;
+
+private:
+	mutable std::mutex mutex_;
+	std::map<std::string, std::unique_ptr<Counter>> counters_;
+	std::map<std::string, std::unique_ptr<Histogram>> histograms_;
+	std::map<std::string, Gauge> gauges_;
+
+private:
+	Metrics();
+
+public:
+	// Returned references stay valid for the process lifetime, cache them
+	Counter &counter(const std::string &name);
+	Histogram &histogram(const std::string &name);
+	ActionStats actionStats(const std::string &action);
+	// Sampled when metrics are read, from any thread and under the registry lock
+	void gauge(const std::string &name, const Gauge &read);
+
+	QJsonObject snapshot() const;
+	void dump() const;
+	QByteArray prometheus() const;
+
+	static RequestPhases &phases();
+};
+
+using MetricsPtr = QSharedPointer<Metrics>;
+
+inline MetricsPtr GetMetrics()
+{
+	static MetricsPtr metrics = QSharedPointer<Metrics>::create();
+	return metrics;
+}
+
+// Records the scope duration into a histogram and an optional accumulator
+class ScopedTimer
+{
+private:
+	Histogram &histogram_;
+	int64_t *accumulator_;
+	int64_t start_;
+
+public:
+	ScopedTimer(Histogram &histogram, int64_t *accumulator = nullptr);
+	~ScopedTimer();
+};
+
+// Times a Database method, the outermost call also counts towards the request DB phase
+class DbTimer
+{
+private:
+	Histogram &histogram_;
+	int64_t start_;
+
+public:
+	DbTimer(Histogram &histogram);
+	~DbTimer();
+};
+
+#define METRIC_DB(name) \
+	static Histogram &__dbHistogram = GetMetrics()->histogram("db." name); \
+	DbTimer __dbTimer(__dbHistogram);
+
+#endif // METRICS_H
@@ -0,0 +1,97 @@
+#include "metricsserver.h"
+#include "metrics.h"
+#include "log.h"
+
+#include <QTimer>
+
+namespace
+{
+
+const int kMaxRequestSize = 8192;
+const int kIdleTimeout = 5000; // Ms a connection may stay open, request and response included
+
+}
+
+MetricsServer::MetricsServer(QObject *parent)
+	: QObject(parent)
+	, server_(new QTcpServer(this))
+{
+	connect(server_, &QTcpServer::newConnection, this, &MetricsServer::newConnection);
+}
+
+MetricsServer::~MetricsServer()
+{
+	stop();
+}
+
+bool MetricsServer::start(int port)
+{
+	if (!server_->listen(QHostAddress::LocalHost, port))
+	{
+		LOGE("Can't start metrics server: " << server_->errorString().toStdString());
+		return false;
+	}
+
+	LOG("Metrics endpoint: http://127.0.0.1:" << port << "/metrics");
+	return true;
+}
+
+void MetricsServer::stop()
+{
+	server_->close();
+}
+
+void MetricsServer::newConnection()
+{
+	while (QTcpSocket *socket = server_->nextPendingConnection())
+	{
+		connect(socket, &QTcpSocket::readyRead, this, &MetricsServer::readRequest);
+		connect(socket, &QTcpSocket::disconnected, socket, &QObject::deleteLater);
+
+		// A client that never completes its header does not keep the socket forever
+		QTimer::singleShot(kIdleTimeout, socket, [socket]() { socket->abort(); });
+	}
+}
+
+void MetricsServer::readRequest()
+{
+	QTcpSocket *socket = qobject_cast<QTcpSocket *>(sender());
+	if (socket == nullptr)
+		return;
+
+	// Wait for the whole header, the body of a GET is ignored.
+	// One response per connection, later data is not read.
+	QByteArray request = socket->peek(kMaxRequestSize);
+	if (!request.contains("\r\n\r\n"))
+	{
+		if (request.size() >= kMaxRequestSize)
+		{
+			disconnect(socket, &QTcpSocket::readyRead, this, &MetricsServer::readRequest);
+			respond(socket, "431 Request Header Fields Too Large", "text/plain", "");
+		}
+		return;
+	}
+
+	socket->readAll();
+	disconnect(socket, &QTcpSocket::readyRead, this, &MetricsServer::readRequest);
+
+	QList<QByteArray> line = request.left(request.indexOf("\r\n")).split(' ');
+	QByteArray method = line.value(0);
+	QByteArray path = line.value(1);
+	if (method != "GET")
+		respond(socket, "405 Method Not Allowed", "text/plain", "");
+	else if (path != "/metrics" && !path.startsWith("/metrics?"))
+		respond(socket, "404 Not Found", "text/plain", "");
+	else
+		respond(socket, "200 OK", "text/plain; version=0.0.4; charset=utf-8", GetMetrics()->prometheus());
+}
+
+void MetricsServer::respond(QTcpSocket *socket, const QByteArray &status, const QByteArray &type, const QByteArray &body)
+{
+	QByteArray response = "HTTP/1.1 " + status + "\r\n"
+						  "Content-Type: " + type + "\r\n"
+						  "Content-Length: " + QByteArray::number(body.size()) + "\r\n"
+						  "Connection: close\r\n\r\n" + body;
+	socket->write(response);
+	socket->disconnectFromHost();
+}
@@ -0,0 +1,33 @@
+#ifndef METRICSSERVER_H
+#define METRICSSERVER_H
+
+#include <QObject>
+#include <QTcpServer>
+#include <QTcpSocket>
+
+// Minimal HTTP endpoint for scrapers, GET /metrics returns the registry in the
+// Prometheus text format. Listens on localhost only.
+class MetricsServer : public QObject
+{
+	Q_OBJECT
+
+private:
+	QTcpServer *server_;
+
+public:
+	MetricsServer(QObject *parent = nullptr);
+	~MetricsServer();
+
+private slots:
+	void newConnection();
+	void readRequest();
+
+public:
+	bool start(int port);
+	void stop();
+
+private:
+	void respond(QTcpSocket *socket, const QByteArray &status, const QByteArray &type, const QByteArray &body);
+};
+
+#endif // METRICSSERVER_H
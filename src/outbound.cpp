@@ -0,0 +1,183 @@
+#include "outbound.h"
+#include "settings.h"
+#include "metrics.h"
+#include "dispatcher.h"
+#include "log.h"
+
+#include <QJsonObject>
+
+Outbound::Outbound(QObject *parent)
+	: QObject(parent)
+	, highWater_(0)
+	, limit_(0)
+	, policy_(Policy::Coalesce)
+{
+}
+
+void Outbound::start()
+{
+	QVariantMap &params = GetSettings()->params();
+	highWater_ = params["outboundHighWater"].toLongLong();
+	limit_ = params["outboundQueueLimit"].toLongLong();
+
+	QString policy = params["outboundPolicy"].toString();
+	if (policy == "resync")
+		policy_ = Policy::Resync;
+	else if (policy == "disconnect")
+		policy_ = Policy::Disconnect;
+	else
+		policy_ = Policy::Coalesce;
+}
+
+void Outbound::send(QWebSocket *socket, const QByteArray &data, Protocol protocol, Kind kind)
+{
+	if (socket == nullptr)
+		return;
+
+	// Fast path, nothing waits and the socket keeps up
+	QHash<QWebSocket *, Queue>::iterator it = queues_.find(socket);
+	if (it == queues_.end())
+	{
+		if (highWater_ <= 0 || socket->bytesToWrite() < highWater_)
+		{
+			sendFrame(socket, data, protocol);
+			return;
+		}
+
+		static Counter &slow = GetMetrics()->counter("outbound.slowSockets");
+		slow.add();
+
+		it = queues_.insert(socket, Queue());
+		it->protocol = protocol;
+		connect(socket, &QWebSocket::bytesWritten, this, &Outbound::bytesWritten);
+		connect(socket, &QObject::destroyed, this, &Outbound::socketDestroyed);
+	}
+
+	it->frames.push_back({ data, protocol, kind, false });
+	it->bytes += data.size();
+	if (limit_ > 0 && it->bytes > limit_)
+		overflow(socket, *it);
+}
+
+qint64 Outbound::queuedBytes() const
+{
+	qint64 bytes = 0;
+	for (const Queue &queue : queues_)
+		bytes += queue.bytes;
+	return bytes;
+}
+
+qint64 Outbound::bufferedBytes() const
+{
+	qint64 bytes = 0;
+	for (QHash<QWebSocket *, Queue>::const_iterator it = queues_.cbegin(); it != queues_.cend(); ++it)
+		bytes += it.key()->bytesToWrite();
+	return bytes;
+}
+
+qint64 Outbound::maxSocketBytes() const
+{
+	qint64 bytes = 0;
+	for (QHash<QWebSocket *, Queue>::const_iterator it = queues_.cbegin(); it != queues_.cend(); ++it)
+		bytes = qMax(bytes, it->bytes + it.key()->bytesToWrite());
+	return bytes;
+}
+
+void Outbound::bytesWritten()
+{
+	QWebSocket *socket = qobject_cast<QWebSocket *>(sender());
+	if (socket)
+		flush(socket);
+}
+
+void Outbound::socketDestroyed(QObject *object)
+{
+	// Only the pointer value is used, the socket is gone
+	queues_.remove(static_cast<QWebSocket *>(object));
+}
+
+void Outbound::flush(QWebSocket *socket)
+{
+	QHash<QWebSocket *, Queue>::iterator it = queues_.find(socket);
+	if (it == queues_.end())
+		return;
+
+	Queue &queue = it.value();
+	while (!queue.frames.empty() && socket->bytesToWrite() < highWater_)
+	{
+		Frame frame = std::move(queue.frames.front());
+		queue.frames.pop_front();
+		queue.bytes -= frame.data.size();
+		if (frame.marker)
+			queue.resync = false;
+		sendFrame(socket, frame.data, frame.protocol);
+	}
+
+	if (queue.frames.empty())
+		release(socket);
+}
+
+void Outbound::overflow(QWebSocket *socket, Queue &queue)
+{
+	static Counter &coalesced = GetMetrics()->counter("outbound.coalesced");
+	static Counter &disconnects = GetMetrics()->counter("outbound.disconnects");
+
+	if (policy_ == Policy::Coalesce)
+	{
+		// Pushes only carry history the client can sync again, replies stay
+		std::deque<Frame> frames;
+		for (Frame &frame : queue.frames)
+		{
+			if (frame.kind == Kind::Push && !frame.marker)
+			{
+				queue.bytes -= frame.data.size();
+				coalesced.add();
+			}
+			else
+				frames.push_back(std::move(frame));
+		}
+
+		queue.frames.swap(frames);
+		addMarker(queue);
+		if (queue.bytes <= limit_)
+			return;
+	}
+	else if (policy_ == Policy::Resync)
+	{
+		queue.frames.clear();
+		queue.bytes = 0;
+		queue.resync = false;
+		addMarker(queue);
+		return;
+	}
+
+	// Replies alone are over the limit, or the policy is to disconnect
+	disconnects.add();
+	LOGW("Slow consumer disconnected, queued: " << queue.bytes << " bytes, buffered: " << socket->bytesToWrite());
+	release(socket);
+	socket->close(QWebSocketProtocol::CloseCodePolicyViolated, "Slow consumer");
+}
+
+void Outbound::addMarker(Queue &queue)
+{
+	static Counter &resyncs = GetMetrics()->counter("outbound.resyncs");
+	if (queue.resync)
+		return;
+
+	resyncs.add();
+	QJsonObject root;
+	root["action"] = static_cast<int>(Dispatcher::Action::Sync);
+	root["code"] = static_cast<int>(Dispatcher::ErrorCode::Ok);
+	root["resync"] = true;
+
+	QByteArray data = encodeMessage(root, queue.protocol);
+	queue.frames.push_back({ data, queue.protocol, Kind::Reply, true });
+	queue.bytes += data.size();
+	queue.resync = true;
+}
+
+void Outbound::release(QWebSocket *socket)
+{
+	disconnect(socket, nullptr, this, nullptr);
+	queues_.remove(socket);
+}
@@ -0,0 +1,86 @@
+#ifndef OUTBOUND_H
+#define OUTBOUND_H
+
+#include <QObject>
+#include <QWebSocket>
+#include <QHash>
+#include <QByteArray>
+
+#include "protocol.h"
+
+#include <deque>
+
+// Outbound frames of slow sockets. A frame goes straight to the socket while its
+// write buffer (bytesToWrite) is below "outboundHighWater", otherwise it waits in
+// a per-socket queue that is flushed as the socket drains. A queue over
+// "outboundQueueLimit" bytes is handled by "outboundPolicy":
+//   coalesce   - queued pushes are replaced with one resync marker, replies stay
+//   resync     - the whole queue is replaced with one resync marker
+//   disconnect - the socket is closed
+// The resync marker is a Sync message with "resync" set, the client syncs from its
+// cursor. Lives on the main thread with the sockets.
+class Outbound : public QObject
+{
+	Q_OBJECT
+
+public:
+	enum class Kind
+	{
+		Reply,
+		Push
+	};
+
+	enum class Policy
+	{
+		Coalesce,
+		Resync,
+		Disconnect
+	};
+
+private:
+	struct Frame
+	{
+		QByteArray data;
+		Protocol protocol;
+		Kind kind;
+		bool marker;
+	};
+
+	struct Queue
+	{
+		std::deque<Frame> frames;
+		qint64 bytes = 0;
+		bool resync = false; // A marker is queued
+		Protocol protocol = Protocol::Json; // Of the marker
+	};
+
+	QHash<QWebSocket *, Queue> queues_;
+	qint64 highWater_;
+	qint64 limit_;
+	Policy policy_;
+
+public:
+	Outbound(QObject *parent = nullptr);
+
+public:
+	void start();
+	void send(QWebSocket *socket, const QByteArray &data, Protocol protocol, Kind kind);
+
+	// Main thread only
+	qint64 queuedBytes() const;
+	qint64 bufferedBytes() const;
+	qint64 maxSocketBytes() const;
+	int slowSockets() const { return queues_.size(); }
+
+private slots:
+	void bytesWritten();
+	void socketDestroyed(QObject *object);
+
+private:
+	void flush(QWebSocket *socket);
+	void overflow(QWebSocket *socket, Queue &queue);
+	void addMarker(Queue &queue);
+	void release(QWebSocket *socket);
+};
+
+#endif // OUTBOUND_H
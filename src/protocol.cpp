@@ -0,0 +1,148 @@
+#include "protocol.h"
+#include "settings.h"
+#include "metrics.h"
+#include "dispatcher.h"
+
+#include <QWebSocket>
+#include <QJsonDocument>
+#include <QCborValue>
+#include <QCborMap>
+#include <QCborParserError>
+
+#ifdef MATY_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+namespace
+{
+
+#ifdef MATY_HAVE_ZSTD
+QByteArray zstdCompress(const QByteArray &data)
+{
+	// One context per thread, reused for every frame of its connections
+	struct Context
+	{
+		ZSTD_CCtx *cctx = ZSTD_createCCtx();
+		~Context() { ZSTD_freeCCtx(cctx); }
+	};
+	thread_local Context context;
+
+	QByteArray out(static_cast<int>(ZSTD_compressBound(data.size())), Qt::Uninitialized);
+	size_t size = ZSTD_compressCCtx(context.cctx, out.data(), out.size(), data.constData(), data.size(),
+									ZSTD_CLEVEL_DEFAULT);
+	if (ZSTD_isError(size))
+		return QByteArray();
+
+	out.truncate(static_cast<int>(size));
+	return out;
+}
+#endif
+
+}
+
+QByteArray encodeMessage(const QJsonObject &object, Protocol protocol, Compression compression)
+{
+	Dispatcher::actionStats(static_cast<Dispatcher::Action>(object["action"].toInt())).sent->add();
+
+	QByteArray data;
+	if (protocol == Protocol::Cbor)
+		data = QCborMap::fromJsonObject(object).toCborValue().toCbor();
+	else
+		data = QJsonDocument(object).toJson(QJsonDocument::Compact);
+
+	return compressFrame(data, compression);
+}
+
+QByteArray compressFrame(const QByteArray &data, Compression compression)
+{
+	static const int threshold = GetSettings()->params()["compressThreshold"].toInt();
+	if (compression == Compression::None || data.size() < threshold)
+		return data;
+
+	static Counter &saved = GetMetrics()->counter("protocol.compressedBytesSaved");
+	QByteArray packed;
+	quint64 tag = kZlibFrameTag;
+
+#ifdef MATY_HAVE_ZSTD
+	if (compression == Compression::Zstd)
+	{
+		packed = zstdCompress(data);
+		tag = kZstdFrameTag;
+	}
+	else
+#endif
+		packed = qCompress(data);
+
+	// Incompressible payload, the plain frame is smaller
+	if (packed.isEmpty() || packed.size() >= data.size())
+		return data;
+
+	saved.add(data.size() - packed.size());
+	return QCborValue(QCborTag(tag), QCborValue(packed)).toCbor();
+}
+
+bool decodeMessage(const QByteArray &data, Protocol protocol, QJsonObject &object, QString &error)
+{
+	if (protocol == Protocol::Cbor)
+	{
+		QCborParserError parserError;
+		QCborValue value = QCborValue::fromCbor(data, &parserError);
+		if (parserError.error != QCborError::NoError)
+		{
+			error = parserError.errorString();
+			return false;
+		}
+
+		if (!value.isMap())
+		{
+			error = "CBOR message is not a map";
+			return false;
+		}
+
+		object = value.toMap().toJsonObject();
+		return true;
+	}
+
+	QJsonParseError parseError;
+	QJsonDocument document = QJsonDocument::fromJson(data, &parseError);
+	if (parseError.error != QJsonParseError::NoError)
+	{
+		error = parseError.errorString();
+		return false;
+	}
+
+	object = document.object();
+	return true;
+}
+
+void sendFrame(QWebSocket *socket, const QByteArray &data, Protocol protocol)
+{
+	static Counter &messages = GetMetrics()->counter("server.messagesOut");
+	static Counter &bytes = GetMetrics()->counter("server.bytesOut");
+	messages.add();
+	bytes.add(static_cast<uint64_t>(data.size()));
+
+	// A JSON message starts with '{', a compressed frame with a CBOR tag header
+	bool compressed = !data.isEmpty() && (static_cast<uchar>(data[0]) & 0xe0) == 0xc0;
+	if (protocol == Protocol::Cbor || compressed)
+		socket->sendBinaryMessage(data);
+	else
+		socket->sendTextMessage(QString::fromUtf8(data));
+}
+
+Compression negotiateCompression(int requested)
+{
+	if (requested == static_cast<int>(Compression::Zstd))
+	{
+#ifdef MATY_HAVE_ZSTD
+		return Compression::Zstd;
+#else
+		return Compression::Zlib;
+#endif
+	}
+
+	if (requested == static_cast<int>(Compression::Zlib))
+		return Compression::Zlib;
+
+	return Compression::None;
+}
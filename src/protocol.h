@@ -0,0 +1,39 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <QByteArray>
+#include <QJsonObject>
+#include <QString>
+
+class QWebSocket;
+
+// Wire format of a message. Old clients send JSON in text frames, clients that
+// opt in send CBOR maps in binary frames. Both carry the same keys and the same
+// Dispatcher::Action codes, so every action is handled by one code path.
+enum class Protocol
+{
+	Json,
+	Cbor
+};
+
+// Compression of server frames, negotiated at auth. A compressed frame is always
+// binary and holds a CBOR tag wrapping a byte string with the compressed message
+// in the connection's protocol. Messages below "compressThreshold" bytes are sent
+// as is, so a JSON client still gets small messages in text frames.
+enum class Compression
+{
+	None,
+	Zlib, // qCompress output: 4 byte big endian size, then a zlib stream
+	Zstd  // zstd frame, only when the server is built with zstd
+};
+
+constexpr quint64 kZlibFrameTag = 1978001;
+constexpr quint64 kZstdFrameTag = 1978002;
+
+QByteArray encodeMessage(const QJsonObject &object, Protocol protocol, Compression compression = Compression::None);
+QByteArray compressFrame(const QByteArray &data, Compression compression);
+bool decodeMessage(const QByteArray &data, Protocol protocol, QJsonObject &object, QString &error);
+void sendFrame(QWebSocket *socket, const QByteArray &data, Protocol protocol);
+Compression negotiateCompression(int requested);
+
+#endif // PROTOCOL_H
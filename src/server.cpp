@@ -2,10 +2,74 @@
 #include "log.h"
 #include "settings.h"
 #include "dispatcher.h"
+#include "metrics.h"
+
+#ifdef Q_OS_UNIX
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+
+#ifdef Q_OS_UNIX
+// Listening socket shared by the shards, the kernel spreads the connections between them
+int reusePortSocket(int port)
+{
+	int fd = socket(AF_INET6, SOCK_STREAM, 0);
+	bool ipv6 = fd >= 0;
+	if (!ipv6)
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+
+	int on = 1, off = 0;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0)
+	{
+		close(fd);
+		return -1;
+	}
+
+	int result = -1;
+	if (ipv6)
+	{
+		// Dual stack, like QHostAddress::Any
+		setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+		sockaddr_in6 address = {};
+		address.sin6_family = AF_INET6;
+		address.sin6_port = htons(static_cast<quint16>(port));
+		address.sin6_addr = in6addr_any;
+		result = bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address));
+	}
+	else
+	{
+		sockaddr_in address = {};
+		address.sin_family = AF_INET;
+		address.sin_port = htons(static_cast<quint16>(port));
+		address.sin_addr.s_addr = htonl(INADDR_ANY);
+		result = bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address));
+	}
+
+	if (result != 0 || listen(fd, SOMAXCONN) != 0)
+	{
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+#endif
+
+}
 
 Server::Server()
 	: server_(new QWebSocketServer("Maty Server", QWebSocketServer::NonSecureMode, this))
+	, metrics_(new MetricsServer(this))
+	, connections_(0)
 {
+	GetMetrics()->gauge("server.connections", [this]() { return connections_.load(); });
 }
 
 Server::~Server()
@@ -15,8 +79,25 @@ Server::~Server()
 
 bool Server::start()
 {
-	int port = GetSettings()->params()["port"].toInt();
-	if (!server_->listen(QHostAddress::Any, port))
+	QVariantMap &params = GetSettings()->params();
+	int port = params["port"].toInt();
+	int shard = params["shard"].toInt();
+	bool listening = false;
+	if (params["shards"].toInt() > 1)
+	{
+#ifdef Q_OS_UNIX
+		int fd = reusePortSocket(port);
+		listening = fd >= 0 && server_->setSocketDescriptor(fd);
+		if (fd >= 0 && !listening)
+			::close(fd);
+#else
+		LOGE("Shards need SO_REUSEPORT, not available on this platform!");
+#endif
+	}
+	else
+		listening = server_->listen(QHostAddress::Any, port);
+
+	if (!listening)
 	{
 		LOGE("Can't start WebSocket Server!");
 		return false;
@@ -24,16 +105,27 @@ bool Server::start()
 
 	connect(server_, &QWebSocketServer::newConnection, this, &Server::newConnection);
 	connect(server_, &QWebSocketServer::closed, this, &Server::closed);
+
+	// Observability is optional, the server runs without it
+	int metricsPort = GetSettings()->params()["metricsPort"].toInt();
+	if (metricsPort > 0)
+		metrics_->start(metricsPort + shard); // One endpoint per shard
+
 	return true;
 }
 
 void Server::stop()
 {
+	metrics_->stop();
 	server_->close();
 }
 
 void Server::newConnection()
 {
+	static Counter &accepted = GetMetrics()->counter("server.accepted");
+	accepted.add();
+	++connections_;
+
 	QWebSocket *socket = server_->nextPendingConnection();
 	connect(socket, &QWebSocket::textMessageReceived, this, &Server::processTextMessage);
 	connect(socket, &QWebSocket::binaryMessageReceived, this, &Server::processBinaryMessage);
@@ -52,6 +144,8 @@ void Server::processTextMessage(const QString &message)
 
 void Server::processBinaryMessage(const QByteArray &message)
 {
+	QWebSocket *socket = qobject_cast<QWebSocket *>(sender());
+	emit binaryMessageReceived(message, socket);
 }
 
 void Server::socketDisconnected()
@@ -59,8 +153,14 @@ void Server::socketDisconnected()
 	QWebSocket *socket = qobject_cast<QWebSocket *>(sender());
 	if (socket)
 	{
-		GetDispatcher()->clientService().remove(socket);
-		//socket->deleteLater();
+		--connections_;
+
+		// Authorized sockets are released by their client's socket pointer
+		ClientService &clientService = GetDispatcher()->clientService();
+		if (clientService.find(socket) != nullptr)
+			clientService.remove(socket);
+		else
+			socket->deleteLater();
 	}
 }
 
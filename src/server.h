@@ -6,6 +6,34 @@
 #include <QWebSocket>
 #include <QString>
 #include <QList>
+#include <QPointer>
+
+#include "protocol.h"
+#include "metricsserver.h"
+
+#include <atomic>
+
+// Socket handle that may cross threads, dereference it only on the socket's thread.
+// Also remembers the protocol of the request and the compression of the connection,
+// replies use the same ones.
+class SocketRef : public QPointer<QWebSocket>
+{
+private:
+	Protocol protocol_;
+	Compression compression_;
+
+public:
+	SocketRef(QWebSocket *socket = nullptr, Protocol protocol = Protocol::Json,
+			  Compression compression = Compression::None)
+		: QPointer<QWebSocket>(socket)
+		, protocol_(protocol)
+		, compression_(compression)
+	{
+	}
+
+	Protocol protocol() const { return protocol_; }
+	Compression compression() const { return compression_; }
+};
 
 class Server : public QObject
 {
@@ -13,6 +41,8 @@ class Server : public QObject
 
 private:
 	QWebSocketServer *server_;
+	MetricsServer *metrics_;
+	std::atomic_int connections_;
 
 public:
 	Server();
@@ -20,6 +50,7 @@ public:
 
 signals:
 	void messageReceived(const QString &message, QWebSocket *socket);
+	void binaryMessageReceived(const QByteArray &message, QWebSocket *socket);
 
 private slots:
 	void newConnection();
@@ -0,0 +1,97 @@
+#include "sessiontokens.h"
+#include "settings.h"
+#include "log.h"
+
+#include <QDir>
+#include <QFile>
+#include <QSaveFile>
+#include <QDateTime>
+#include <QMessageAuthenticationCode>
+#include <QCryptographicHash>
+#include <QRandomGenerator>
+
+namespace
+{
+
+const int kKeySize = 32;
+const QByteArray::Base64Options kBase64 = QByteArray::Base64UrlEncoding | QByteArray::OmitTrailingEquals;
+
+}
+
+SessionTokens::SessionTokens()
+	: key_(loadKey())
+	, lifetime_(GetSettings()->params()["sessionLifetime"].toLongLong())
+{
+}
+
+QString SessionTokens::issue(int id, const QString &login, qint64 *expires) const
+{
+	qint64 expiry = QDateTime::currentSecsSinceEpoch() + lifetime_;
+	if (expires)
+		*expires = expiry;
+
+	QByteArray payload = QByteArray::number(id) + ':' + QByteArray::number(expiry) + ':' + login.toUtf8();
+	return QString::fromLatin1(payload.toBase64(kBase64) + '.' + sign(payload).toBase64(kBase64));
+}
+
+bool SessionTokens::verify(const QString &token, int &id, QString &login) const
+{
+	int dot = token.indexOf('.');
+	if (dot <= 0 || key_.isEmpty())
+		return false;
+
+	QByteArray payload = QByteArray::fromBase64(token.left(dot).toLatin1(), kBase64);
+	QByteArray signature = QByteArray::fromBase64(token.mid(dot + 1).toLatin1(), kBase64);
+	QByteArray expected = sign(payload);
+	if (signature.size() != expected.size())
+		return false;
+
+	// Constant time, a mismatch position must not show in the timing
+	char diff = 0;
+	for (int i = 0; i < expected.size(); ++i)
+		diff |= signature[i] ^ expected[i];
+	if (diff != 0)
+		return false;
+
+	int first = payload.indexOf(':');
+	int second = payload.indexOf(':', first + 1);
+	if (first <= 0 || second <= first)
+		return false;
+
+	bool idOk = false, expiryOk = false;
+	id = payload.left(first).toInt(&idOk);
+	qint64 expiry = payload.mid(first + 1, second - first - 1).toLongLong(&expiryOk);
+	login = QString::fromUtf8(payload.mid(second + 1));
+	return idOk && expiryOk && expiry > QDateTime::currentSecsSinceEpoch();
+}
+
+QByteArray SessionTokens::sign(const QByteArray &payload) const
+{
+	return QMessageAuthenticationCode::hash(payload, key_, QCryptographicHash::Sha256);
+}
+
+QByteArray SessionTokens::loadKey()
+{
+	QString fileName = Settings::dataPath() + QDir::separator() + "session.key";
+	QFile file(fileName);
+	if (file.open(QIODevice::ReadOnly))
+	{
+		QByteArray key = file.readAll();
+		if (key.size() == kKeySize)
+			return key;
+		LOGW("Invalid session key, creating a new one");
+	}
+
+	// A new key invalidates every token issued before
+	QByteArray key(kKeySize, Qt::Uninitialized);
+	QRandomGenerator::system()->fillRange(reinterpret_cast<quint32 *>(key.data()), kKeySize / sizeof(quint32));
+
+	// Owner only before the rename, the key is never readable by others
+	QSaveFile save(fileName);
+	if (!save.open(QIODevice::WriteOnly) ||
+		!save.setPermissions(QFileDevice::ReadOwner | QFileDevice::WriteOwner) ||
+		save.write(key) != key.size() || !save.commit())
+		LOGE("Can't write session key: " << fileName.toStdString());
+
+	return key;
+}
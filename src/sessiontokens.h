@@ -0,0 +1,41 @@
+#ifndef SESSIONTOKENS_H
+#define SESSIONTOKENS_H
+
+#include <QString>
+#include <QByteArray>
+#include <QSharedPointer>
+
+// Signed session tokens, issued at auth and checked on resume without a database
+// query. A token is "<payload>.<signature>" in base64url, the payload holds the
+// contact id, the expiry time and the login, the signature is HMAC-SHA256 of the
+// payload. The key is created once and kept in the data directory, so tokens
+// survive restarts.
+class SessionTokens
+{
+	friend class QSharedPointer<SessionTokens>;
+
+private:
+	QByteArray key_;
+	qint64 lifetime_; // Seconds
+
+private:
+	SessionTokens();
+
+public:
+	QString issue(int id, const QString &login, qint64 *expires = nullptr) const;
+	bool verify(const QString &token, int &id, QString &login) const;
+
+private:
+	QByteArray sign(const QByteArray &payload) const;
+	static QByteArray loadKey();
+};
+
+using SessionTokensPtr = QSharedPointer<SessionTokens>;
+
+inline SessionTokensPtr GetSessionTokens()
+{
+	static SessionTokensPtr tokens = QSharedPointer<SessionTokens>::create();
+	return tokens;
+}
+
+#endif // SESSIONTOKENS_H
@@ -9,11 +9,38 @@
 #include <QDebug>
 #include <QJsonDocument>
 #include <QJsonObject>
+#include <QThread>
 
 Settings::Settings(QObject *parent)
 	: QObject{parent}
 {
 	params_["port"] = 1978;
+	params_["historyPollInterval"] = 0; // Safety net history poll, ms (0 - push on write only)
+	params_["dbFile"] = ""; // Database file (empty - data/db/data.db)
+	params_["dbCacheSize"] = 65536; // SQLite page cache per connection, KiB
+	params_["workers"] = QThread::idealThreadCount(); // Request threads (0 - run on the main thread)
+	params_["logAsync"] = true; // Write the log from a background thread
+	params_["logQueueSize"] = 65536; // Async log ring buffer, lines
+	params_["logOverflow"] = "drop"; // Full log queue: "drop" and count, or "block"
+	params_["logFlushInterval"] = 100; // Async log flush period, ms
+	params_["logFlushSize"] = 65536; // Async log flush threshold, bytes
+	params_["contactCacheSize"] = 10000; // Cached contacts (0 - off)
+	params_["compressThreshold"] = 1024; // Smaller frames are sent uncompressed
+	params_["historyWriteQueue"] = 4096; // Queued history writes before callers block
+	params_["historyWriteBatch"] = 256; // History writes per commit
+	params_["historyWriteDelay"] = 5; // Ms a history write waits for its group
+	params_["historyBatchLimit"] = 500; // Max messages per AddHistoryBatch
+	params_["sessionLifetime"] = 30 * 24 * 3600; // Session token lifetime, s
+	params_["outboundHighWater"] = 256 * 1024; // Socket write buffer above which frames queue, bytes (0 - off)
+	params_["outboundQueueLimit"] = 4 * 1024 * 1024; // Queued bytes of one socket before outboundPolicy applies
+	params_["outboundPolicy"] = "coalesce"; // Full queue: "coalesce" pushes, "resync" or "disconnect"
+	params_["avatarCacheSize"] = 256; // Avatar files kept mapped
+	params_["historyHeadSize"] = 20; // Latest messages per conversation sent on auth
+	params_["historyPageLimit"] = 100; // Max messages per QueryHistory page
+	params_["shards"] = 1; // Server processes sharing the port (Unix only)
+	params_["shard"] = 0; // Index of this process, set by the command line
+	params_["metricsPort"] = 9178; // Local Prometheus endpoint (0 - off)
+	params_["metricsInterval"] = 60; // Metrics dump to the log period, s (0 - off)
 }
 
 QString Settings::logPath() const
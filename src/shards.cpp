@@ -0,0 +1,483 @@
+#include "shards.h"
+#include "client.h"
+#include "outbound.h"
+#include "database.h"
+#include "settings.h"
+#include "metrics.h"
+#include "sessiontokens.h"
+#include "log.h"
+
+#include <QCoreApplication>
+#include <QDir>
+#include <QJsonArray>
+#include <QCborMap>
+#include <QCborValue>
+#include <QtEndian>
+
+#ifdef Q_OS_LINUX
+#include <sys/prctl.h>
+#include <csignal>
+#include <unistd.h>
+#endif
+
+namespace
+{
+
+// Restart delay of a shard, doubled on each exit until it stays up for kStableUptime
+constexpr int kRestartDelay = 1000;
+constexpr int kMaxRestartDelay = 60000;
+constexpr qint64 kStableUptime = 60000;
+
+// Frames on the shard links: 4 byte big endian size, then a CBOR map
+QByteArray frame(const QJsonObject &message)
+{
+	QByteArray body = QCborMap::fromJsonObject(message).toCborValue().toCbor();
+	QByteArray data(4, Qt::Uninitialized);
+	qToBigEndian<quint32>(static_cast<quint32>(body.size()), data.data());
+	return data + body;
+}
+
+}
+
+Shards::Shards(QObject *parent)
+	: QObject(parent)
+	, shard_(0)
+	, count_(1)
+	, clientService_(nullptr)
+	, outbound_(nullptr)
+	, server_(new QLocalServer(this))
+{
+	connect(server_, &QLocalServer::newConnection, this, &Shards::newConnection);
+	connect(&reconnectTimer_, &QTimer::timeout, this, &Shards::connectPeers);
+}
+
+Shards::~Shards()
+{
+	stop();
+}
+
+bool Shards::start(ClientService &clientService, Outbound &outbound)
+{
+	QVariantMap &params = GetSettings()->params();
+	count_ = qMax(params["shards"].toInt(), 1);
+	shard_ = qBound(0, params["shard"].toInt(), count_ - 1);
+	clientService_ = &clientService;
+	outbound_ = &outbound;
+	if (!enabled())
+		return true;
+
+	QDir(Settings::dataPath()).mkpath("run");
+
+	// A socket file left by a crash is removed, one a live process answers on is not
+	QLocalSocket probe;
+	probe.connectToServer(socketName(shard_));
+	if (probe.waitForConnected(500))
+	{
+		LOGE("Shard " << shard_ << " is already running");
+		return false;
+	}
+
+	QLocalServer::removeServer(socketName(shard_));
+	server_->setSocketOptions(QLocalServer::UserAccessOption);
+	if (!server_->listen(socketName(shard_)))
+	{
+		LOGE("Can't listen on shard socket: " << server_->errorString().toStdString());
+		return false;
+	}
+
+	connect(clientService_, &ClientService::presenceChanged, this, &Shards::presenceChanged);
+	GetMetrics()->gauge("shards.peers", [this]() {
+		int connected = 0;
+		for (QLocalSocket *peer : peers_)
+			connected += peer->state() == QLocalSocket::ConnectedState;
+		return connected;
+	});
+
+	// The session key is created here, before the other shards would each create their own
+	if (shard_ == 0)
+	{
+		GetSessionTokens();
+		startProcesses();
+	}
+
+	// Peers start in any order, keep trying until every link is up
+	connectPeers();
+	reconnectTimer_.start(1000);
+	LOG("Shard " << shard_ << " of " << count_);
+	return true;
+}
+
+void Shards::stop()
+{
+	reconnectTimer_.stop();
+	for (QProcess *process : processes_)
+	{
+		process->disconnect(this);
+		process->terminate();
+		if (!process->waitForFinished(5000))
+			process->kill();
+	}
+
+	qDeleteAll(processes_);
+	processes_.clear();
+	uptimes_.clear();
+	restartDelays_.clear();
+	for (QLocalSocket *peer : peers_)
+		peer->disconnect(this);
+	qDeleteAll(peers_);
+	peers_.clear();
+	server_->close();
+}
+
+bool Shards::isOwner(int id) const
+{
+	if (!enabled())
+		return true;
+
+	int shard = owner(id);
+	return shard < 0 || shard == shard_;
+}
+
+bool Shards::online(int id) const
+{
+	// Devices of the contact on any shard, this one included
+	if (!enabled())
+		return !clientService_->findAll(id).isEmpty();
+
+	return owner(id) >= 0;
+}
+
+int Shards::owner(int id) const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	QHash<int, QHash<int, int>>::const_iterator it = directory_.find(id);
+	if (it == directory_.end() || it->isEmpty())
+		return -1;
+
+	int owner = count_;
+	for (QHash<int, int>::const_iterator shard = it->cbegin(); shard != it->cend(); ++shard)
+		owner = qMin(owner, shard.key());
+	return owner;
+}
+
+void Shards::notify(int id, HistoryState state)
+{
+	// The owner pushes to its own devices and forwards to the other shards
+	int shard = enabled() ? owner(id) : -1;
+	if (shard < 0 || shard == shard_)
+	{
+		clientService_->notify(id, state);
+		return;
+	}
+
+	QJsonObject message;
+	message["type"] = "notify";
+	message["id"] = id;
+	message["state"] = static_cast<int>(state);
+	QMetaObject::invokeMethod(this, [this, shard, message]() { send(shard, message); }, Qt::QueuedConnection);
+}
+
+bool Shards::deliver(int id, const QJsonObject &message, bool remoteOnly)
+{
+	if (!enabled())
+	{
+		if (remoteOnly)
+			return false;
+
+		QMetaObject::invokeMethod(this, [this, id, message]() { deliverLocal(id, message); }, Qt::QueuedConnection);
+		return !clientService_->findAll(id).isEmpty();
+	}
+
+	QList<int> shards;
+	bool local = false;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		const QHash<int, int> devices = directory_.value(id);
+		for (QHash<int, int>::const_iterator it = devices.cbegin(); it != devices.cend(); ++it)
+		{
+			if (it.key() == shard_)
+				local = true;
+			else
+				shards.push_back(it.key());
+		}
+	}
+
+	if (local && !remoteOnly)
+		QMetaObject::invokeMethod(this, [this, id, message]() { deliverLocal(id, message); }, Qt::QueuedConnection);
+
+	if (!shards.isEmpty())
+	{
+		QJsonObject root;
+		root["type"] = "deliver";
+		root["id"] = id;
+		root["message"] = message;
+		QMetaObject::invokeMethod(this, [this, shards, root]() {
+			for (int shard : shards)
+				send(shard, root);
+		}, Qt::QueuedConnection);
+	}
+
+	return local || !shards.isEmpty();
+}
+
+void Shards::presenceChanged(int id, int count)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		QHash<int, int> &devices = directory_[id];
+		if (count > 0)
+			devices[shard_] = count;
+		else
+			devices.remove(shard_);
+		if (devices.isEmpty())
+			directory_.remove(id);
+	}
+
+	QJsonObject message;
+	message["type"] = "presence";
+	message["id"] = id;
+	message["count"] = count;
+	broadcast(message);
+}
+
+void Shards::newConnection()
+{
+	while (QLocalSocket *socket = server_->nextPendingConnection())
+	{
+		incoming_.insert(socket, QByteArray());
+		connect(socket, &QLocalSocket::readyRead, this, &Shards::readIncoming);
+		connect(socket, &QLocalSocket::disconnected, this, &Shards::incomingDisconnected);
+	}
+}
+
+void Shards::readIncoming()
+{
+	QLocalSocket *socket = qobject_cast<QLocalSocket *>(sender());
+	if (socket == nullptr || !incoming_.contains(socket))
+		return;
+
+	QByteArray &buffer = incoming_[socket];
+	buffer.append(socket->readAll());
+	while (buffer.size() >= 4)
+	{
+		quint32 size = qFromBigEndian<quint32>(buffer.constData());
+		if (buffer.size() < static_cast<int>(size) + 4)
+			break;
+
+		QCborValue value = QCborValue::fromCbor(buffer.mid(4, size));
+		buffer.remove(0, size + 4);
+		if (value.isMap())
+			process(socket, value.toMap().toJsonObject());
+	}
+}
+
+void Shards::incomingDisconnected()
+{
+	QLocalSocket *socket = qobject_cast<QLocalSocket *>(sender());
+	if (socket == nullptr)
+		return;
+
+	// The shard is gone, so are its clients
+	int shard = incomingShards_.take(socket);
+	if (incoming_.remove(socket) > 0 && shard != shard_)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		for (QHash<int, QHash<int, int>>::iterator it = directory_.begin(); it != directory_.end();)
+		{
+			it->remove(shard);
+			it = it->isEmpty() ? directory_.erase(it) : it + 1;
+		}
+	}
+
+	socket->deleteLater();
+}
+
+void Shards::connectPeers()
+{
+	for (int shard = 0; shard < count_; ++shard)
+	{
+		if (shard == shard_)
+			continue;
+
+		QLocalSocket *&peer = peers_[shard];
+		if (peer != nullptr && peer->state() != QLocalSocket::UnconnectedState)
+			continue;
+
+		if (peer == nullptr)
+		{
+			peer = new QLocalSocket(this);
+			connect(peer, &QLocalSocket::connected, this, [this, shard]() { sendSnapshot(shard); });
+
+			// Shard 0 started this one and restarts it, without it the shard is orphaned
+			if (shard == 0)
+			{
+				connect(peer, &QLocalSocket::disconnected, this, []() {
+					LOGE("Lost the link to shard 0, exiting");
+					QCoreApplication::exit(1);
+				});
+			}
+		}
+
+		peer->connectToServer(socketName(shard));
+	}
+}
+
+void Shards::startProcesses()
+{
+	// Same binary and arguments, plus the shard number
+	QStringList arguments = QCoreApplication::arguments().mid(1);
+	for (int shard = 1; shard < count_; ++shard)
+	{
+		QProcess *process = new QProcess();
+		process->setProgram(QCoreApplication::applicationFilePath());
+		process->setArguments(arguments + QStringList({ "--shard", QString::number(shard) }));
+		process->setProcessChannelMode(QProcess::ForwardedChannels);
+#ifdef Q_OS_LINUX
+		// The shard goes down with shard 0, even when shard 0 is killed
+		pid_t parent = getpid();
+		process->setChildProcessModifier([parent]() {
+			prctl(PR_SET_PDEATHSIG, SIGTERM);
+			if (getppid() != parent)
+				_exit(1);
+		});
+#endif
+
+		// A crashed shard is started again, its clients reconnect to the others meanwhile
+		connect(process, qOverload<int, QProcess::ExitStatus>(&QProcess::finished), this, [this, process, shard](int code, QProcess::ExitStatus) {
+			LOGW("Shard " << shard << " exited with code " << code);
+			restartProcess(process, shard);
+		});
+		connect(process, &QProcess::errorOccurred, this, [this, process, shard](QProcess::ProcessError error) {
+			// No finished signal follows a failed start
+			if (error != QProcess::FailedToStart)
+				return;
+
+			LOGW("Can't start shard " << shard << ": " << process->errorString().toStdString());
+			restartProcess(process, shard);
+		});
+
+		restartDelays_[process] = kRestartDelay;
+		uptimes_[process].start();
+		process->start();
+		processes_.push_back(process);
+	}
+}
+
+void Shards::restartProcess(QProcess *process, int shard)
+{
+	// Back off while the shard keeps failing, start over once it ran for a while
+	int &delay = restartDelays_[process];
+	if (uptimes_[process].elapsed() >= kStableUptime)
+		delay = kRestartDelay;
+
+	LOGW("Restarting shard " << shard << " in " << delay << " ms");
+	QTimer::singleShot(delay, process, [this, process]() {
+		uptimes_[process].start();
+		process->start();
+	});
+	delay = qMin(delay * 2, kMaxRestartDelay);
+}
+
+QString Shards::socketName(int shard) const
+{
+	int port = GetSettings()->params()["port"].toInt();
+	return Settings::dataPath() + QDir::separator() + "run" + QDir::separator() +
+		   "maty-" + QString::number(port) + "-" + QString::number(shard) + ".sock";
+}
+
+void Shards::send(int shard, const QJsonObject &message)
+{
+	static Counter &dropped = GetMetrics()->counter("shards.dropped");
+	QLocalSocket *peer = peers_.value(shard);
+	if (peer == nullptr || peer->state() != QLocalSocket::ConnectedState)
+	{
+		// The snapshot sent on reconnect restores the presence, pushes wait for the safety net or a sync
+		dropped.add();
+		return;
+	}
+
+	peer->write(frame(message));
+}
+
+void Shards::broadcast(const QJsonObject &message)
+{
+	for (int shard = 0; shard < count_; ++shard)
+	{
+		if (shard != shard_)
+			send(shard, message);
+	}
+}
+
+void Shards::process(QLocalSocket *socket, const QJsonObject &message)
+{
+	static Counter &received = GetMetrics()->counter("shards.received");
+	received.add();
+
+	QString type = message["type"].toString();
+	if (type == "hello")
+	{
+		// Full presence of the shard, replaces what was known about it
+		int shard = message["shard"].toInt();
+		incomingShards_[socket] = shard;
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		for (QHash<int, QHash<int, int>>::iterator it = directory_.begin(); it != directory_.end();)
+		{
+			it->remove(shard);
+			it = it->isEmpty() ? directory_.erase(it) : it + 1;
+		}
+
+		for (const QJsonValue &value : message["presence"].toArray())
+		{
+			QJsonArray entry = value.toArray();
+			directory_[entry[0].toInt()][shard] = entry[1].toInt();
+		}
+	}
+	else if (type == "presence")
+	{
+		int shard = incomingShards_.value(socket, -1);
+		if (shard < 0)
+			return;
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		int id = message["id"].toInt();
+		QHash<int, int> &devices = directory_[id];
+		if (message["count"].toInt() > 0)
+			devices[shard] = message["count"].toInt();
+		else
+			devices.remove(shard);
+		if (devices.isEmpty())
+			directory_.remove(id);
+	}
+	else if (type == "notify")
+		clientService_->notify(message["id"].toInt(), static_cast<HistoryState>(message["state"].toInt()));
+	else if (type == "deliver")
+		deliverLocal(message["id"].toInt(), message["message"].toObject());
+}
+
+void Shards::deliverLocal(int id, const QJsonObject &message)
+{
+	for (const ClientPtr &client : clientService_->findAll(id))
+		outbound_->send(client->socket().get(), encodeMessage(message, client->protocol(), client->compression()),
+						client->protocol(), Outbound::Kind::Push);
+}
+
+void Shards::sendSnapshot(int shard)
+{
+	QJsonArray presence;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		for (QHash<int, QHash<int, int>>::const_iterator it = directory_.cbegin(); it != directory_.cend(); ++it)
+		{
+			int count = it->value(shard_);
+			if (count > 0)
+				presence.push_back(QJsonArray({ it.key(), count }));
+		}
+	}
+
+	QJsonObject message;
+	message["type"] = "hello";
+	message["shard"] = shard_;
+	message["presence"] = presence;
+	send(shard, message);
+}
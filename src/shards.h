@@ -0,0 +1,85 @@
+#ifndef SHARDS_H
+#define SHARDS_H
+
+#include <QObject>
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QProcess>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QList>
+#include <QJsonObject>
+
+#include <mutex>
+
+class ClientService;
+class Outbound;
+enum class HistoryState;
+
+// Sharded mode: "shards" processes accept on the same port (SO_REUSEPORT) and
+// each owns the clients connected to it. Shards are linked by Unix domain
+// sockets in <data>/run and keep a directory of which contacts are online on
+// which shard. History notifications go to the shard that pushes for the
+// contact (the lowest one it is connected to), direct messages go to every
+// shard with a device of the recipient. Shard 0 starts and restarts the
+// others, which exit when it does.
+class Shards : public QObject
+{
+	Q_OBJECT
+
+private:
+	int shard_;
+	int count_;
+	ClientService *clientService_;
+	Outbound *outbound_;
+
+	QLocalServer *server_;
+	QHash<int, QLocalSocket *> peers_; // Outgoing, by shard
+	QHash<QLocalSocket *, QByteArray> incoming_; // Read buffers
+	QHash<QLocalSocket *, int> incomingShards_;
+	QList<QProcess *> processes_; // Started by shard 0
+	QHash<QProcess *, QElapsedTimer> uptimes_;
+	QHash<QProcess *, int> restartDelays_; // Milliseconds
+	QTimer reconnectTimer_;
+
+	// Contact id -> shard -> connected devices, this shard included
+	mutable std::mutex mutex_;
+	QHash<int, QHash<int, int>> directory_;
+
+public:
+	Shards(QObject *parent = nullptr);
+	~Shards();
+
+public:
+	bool start(ClientService &clientService, Outbound &outbound);
+	void stop();
+	bool enabled() const { return count_ > 1; }
+	int shard() const { return shard_; }
+
+	// Thread safe
+	bool isOwner(int id) const;
+	bool online(int id) const;
+	void notify(int id, HistoryState state);
+	bool deliver(int id, const QJsonObject &message, bool remoteOnly = false);
+
+private slots:
+	void presenceChanged(int id, int count);
+	void newConnection();
+	void readIncoming();
+	void incomingDisconnected();
+	void connectPeers();
+
+private:
+	int owner(int id) const;
+	void startProcesses();
+	void restartProcess(QProcess *process, int shard);
+	QString socketName(int shard) const;
+	void send(int shard, const QJsonObject &message);
+	void broadcast(const QJsonObject &message);
+	void process(QLocalSocket *socket, const QJsonObject &message);
+	void deliverLocal(int id, const QJsonObject &message);
+	void sendSnapshot(int shard);
+};
+
+#endif // SHARDS_H
@@ -0,0 +1,57 @@
+#include "workerpool.h"
+#include "log.h"
+
+#include <QHash>
+
+WorkerPool::WorkerPool()
+{
+}
+
+WorkerPool::~WorkerPool()
+{
+	stop();
+}
+
+void WorkerPool::start(int count)
+{
+	for (int i = 0; i < count; ++i)
+	{
+		QThread *thread = new QThread();
+		thread->setObjectName("worker-" + QString::number(i));
+
+		QObject *context = new QObject();
+		context->moveToThread(thread);
+		connect(thread, &QThread::finished, context, &QObject::deleteLater);
+
+		threads_.push_back(thread);
+		contexts_.push_back(context);
+		thread->start();
+	}
+
+	LOG("Worker threads: " << count);
+}
+
+void WorkerPool::stop()
+{
+	for (QThread *thread : threads_)
+	{
+		thread->quit();
+		thread->wait();
+		delete thread;
+	}
+
+	threads_.clear();
+	contexts_.clear();
+}
+
+void WorkerPool::post(quintptr key, const std::function<void()> &task)
+{
+	if (contexts_.isEmpty())
+	{
+		task();
+		return;
+	}
+
+	QObject *context = contexts_[qHash(key) % contexts_.size()];
+	QMetaObject::invokeMethod(context, task, Qt::QueuedConnection);
+}
@@ -0,0 +1,33 @@
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+#include <QObject>
+#include <QThread>
+#include <QList>
+
+#include <functional>
+
+// Fixed set of worker threads, each running its own event loop
+class WorkerPool : public QObject
+{
+	Q_OBJECT
+
+private:
+	QList<QThread *> threads_;
+	QList<QObject *> contexts_;
+
+public:
+	WorkerPool();
+	~WorkerPool();
+
+public:
+	void start(int count);
+	void stop();
+	int size() const { return threads_.size(); }
+
+	// Tasks with the same key run on the same worker in posting order.
+	// Without workers the task runs immediately on the calling thread.
+	void post(quintptr key, const std::function<void()> &task);
+};
+
+#endif // WORKERPOOL_H
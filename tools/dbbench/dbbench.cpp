@@ -0,0 +1,260 @@
+#include "dbbench.h"
+#include "database.h"
+#include "contactcache.h"
+#include "settings.h"
+#include "common.h"
+
+#include <QDir>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QDateTime>
+#include <QTemporaryDir>
+#include <QSysInfo>
+
+#include <iostream>
+
+DbBench::DbBench(const BenchOptions &options)
+	: options_(options)
+	, random_(1978)
+	, contacts_(0)
+{
+}
+
+bool DbBench::run()
+{
+	QTemporaryDir temporary;
+	QString dir = options_.dir;
+	if (dir.isEmpty())
+	{
+		if (!temporary.isValid())
+		{
+			std::cerr << "Can't create a temporary directory" << std::endl;
+			return false;
+		}
+		dir = temporary.path();
+	}
+	QDir().mkpath(dir);
+
+	QJsonArray runs;
+	for (qint64 rows : options_.sizes)
+	{
+		QString fileName = dir + QDir::separator() + "bench-" + QString::number(rows) + ".db";
+		QJsonObject result;
+		bool ok = runSize(rows, fileName, result);
+
+		// Throwaway database, the next size starts from an empty file
+		GetDatabase()->close();
+		for (const QString &suffix : { "", "-wal", "-shm" })
+			QFile::remove(fileName + suffix);
+
+		if (!ok)
+			return false;
+		runs.push_back(result);
+	}
+
+	QJsonObject report;
+	report["timestamp"] = QDateTime::currentDateTimeUtc().toString(Qt::ISODate);
+	report["qt"] = qVersion();
+	report["cpu"] = QSysInfo::currentCpuArchitecture();
+	report["os"] = QSysInfo::prettyProductName();
+	report["iterations"] = options_.iterations;
+	report["runs"] = runs;
+
+	QByteArray json = QJsonDocument(report).toJson(QJsonDocument::Indented);
+	if (options_.output.isEmpty())
+	{
+		std::cout << json.toStdString();
+		return true;
+	}
+
+	QFile file(options_.output);
+	if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate) || file.write(json) != json.size())
+	{
+		std::cerr << "Can't write " << options_.output.toStdString() << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+bool DbBench::runSize(qint64 rows, const QString &fileName, QJsonObject &result)
+{
+	QFile::remove(fileName);
+	GetSettings()->params()["dbFile"] = fileName;
+	DatabasePtr database = GetDatabase();
+	if (!database->isOpen())
+	{
+		std::cerr << "Can't open " << fileName.toStdString() << std::endl;
+		return false;
+	}
+
+	std::cerr << "History rows: " << rows << std::endl;
+	result["rows"] = rows;
+	if (!fill(rows, result))
+		return false;
+
+	// Time the database, not the contact cache
+	GetContactCache()->clear();
+	GetContactCache()->setCapacity(0);
+
+	QJsonObject methods;
+	methods["appendHistory"] = measure([&]() {
+		QJsonObject history;
+		history["hid"] = 0;
+		history["cid"] = randomContact();
+		history["rid"] = randomContact();
+		history["text"] = "benchmark message";
+		database->appendHistory(history);
+	});
+
+	const QList<QPair<QString, int>> modes = {
+		{ "queryHistoryAll", -1 },
+		{ "queryHistoryPending", -2 },
+		{ "queryHistoryNew", static_cast<int>(HistoryState::Regular) },
+		{ "queryHistoryModified", static_cast<int>(HistoryState::Modified) },
+		{ "queryHistoryRemoved", static_cast<int>(HistoryState::Removed) }
+	};
+
+	for (const QPair<QString, int> &mode : modes)
+	{
+		methods[mode.first] = measure([&]() {
+			QVariantMap options;
+			options["all"] = mode.second == -1;
+			if (mode.second >= 0)
+				options["state"] = mode.second;
+			options["cid"] = randomContact();
+			VariantMapList list;
+			database->queryHistory(list, options);
+		});
+	}
+
+	methods["setDeliveredSeq"] = measure([&]() { database->setDeliveredSeq(randomContact(), rows); });
+	methods["setReadCursor"] = measure([&]() { database->setReadCursor(randomContact(), randomContact(), rows); });
+	methods["queryUnread"] = measure([&]() {
+		QJsonArray unread;
+		database->queryUnread(unread, randomContact());
+	});
+
+	methods["searchContacts"] = measure([&]() {
+		QJsonObject object;
+		database->searchContacts(object, login(randomContact()).left(6), randomContact());
+	});
+
+	methods["queryContactByLogin"] = measure([&]() {
+		QJsonObject contact;
+		database->queryContact(contact, login(randomContact()));
+	});
+
+	methods["queryContactById"] = measure([&]() {
+		QJsonObject contact;
+		database->queryContact(contact, randomContact());
+	});
+
+	methods["queryLinks"] = measure([&]() { database->queryLinks(randomContact()); });
+
+	methods["linkExists"] = measure([&]() {
+		QJsonObject link;
+		link["cid"] = randomContact();
+		link["rid"] = randomContact();
+		database->linkExists(link);
+	});
+
+	GetContactCache()->setCapacity(GetSettings()->params()["contactCacheSize"].toInt());
+	result["methods"] = methods;
+	return true;
+}
+
+bool DbBench::fill(qint64 rows, QJsonObject &result)
+{
+	int64_t start = steady_micro();
+	DatabasePtr database = GetDatabase();
+	contacts_ = static_cast<int>(qMax<qint64>(rows / qMax(options_.contactsPerRows, 1), 2));
+
+	// Large transactions, the fill is not what is measured
+	const int chunk = 10000;
+	database->beginTransaction();
+	for (int i = 1; i <= contacts_; ++i)
+	{
+		QJsonObject contact;
+		contact["name"] = login(i);
+		contact["login"] = login(i);
+		contact["password"] = "password";
+		contact["phone"] = "";
+		database->appendContact(contact);
+
+		if (i % chunk == 0)
+		{
+			database->commitTransaction();
+			database->beginTransaction();
+		}
+	}
+
+	// Distinct peers other than the contact itself, linkcontacts (cid, rid) is unique
+	int links = qMin(options_.links, contacts_ - 1);
+	for (int i = 1; i <= contacts_; ++i)
+	{
+		int base = std::uniform_int_distribution<int>(0, contacts_ - 2)(random_);
+		for (int j = 0; j < links; ++j)
+		{
+			QJsonObject link;
+			link["cid"] = i;
+			link["rid"] = (i + (base + j) % (contacts_ - 1)) % contacts_ + 1;
+			database->linkContact(link);
+		}
+
+		if (i % (chunk / qMax(links, 1) + 1) == 0)
+		{
+			database->commitTransaction();
+			database->beginTransaction();
+		}
+	}
+
+	// Mostly read history, every hundredth message still waits for its recipient
+	for (qint64 i = 0; i < rows; ++i)
+	{
+		QJsonObject history;
+		history["hid"] = static_cast<qint64>(i);
+		history["cid"] = randomContact();
+		history["rid"] = randomContact();
+		history["text"] = "synthetic message " + QString::number(i);
+		database->appendHistory(history, i % 100 != 0);
+
+		if ((i + 1) % chunk == 0)
+		{
+			database->commitTransaction();
+			database->beginTransaction();
+		}
+	}
+
+	if (!database->commitTransaction())
+		return false;
+
+	result["contacts"] = contacts_;
+	result["links"] = static_cast<qint64>(contacts_) * links;
+	result["fillTime"] = static_cast<double>(steady_micro() - start) / 1e6;
+	return true;
+}
+
+QJsonObject DbBench::measure(const std::function<void()> &call)
+{
+	Histogram histogram;
+	for (int i = 0; i < options_.iterations; ++i)
+	{
+		int64_t start = steady_micro();
+		call();
+		histogram.record(steady_micro() - start);
+	}
+
+	return histogram.toJson();
+}
+
+int DbBench::randomContact()
+{
+	return std::uniform_int_distribution<int>(1, contacts_)(random_);
+}
+
+QString DbBench::login(int id)
+{
+	return "user" + QString::number(id);
+}
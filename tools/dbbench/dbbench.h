@@ -0,0 +1,47 @@
+#ifndef DBBENCH_H
+#define DBBENCH_H
+
+#include <QString>
+#include <QList>
+#include <QJsonObject>
+
+#include <functional>
+#include <random>
+
+#include "metrics.h"
+
+// Run parameters, set from the command line
+struct BenchOptions
+{
+	QList<qint64> sizes = { 1000, 10000, 100000, 1000000 }; // History rows per run
+	int contactsPerRows = 100; // One contact per this many history rows
+	int links = 10; // Linked contacts of every contact
+	int iterations = 1000; // Calls of each method
+	QString dir; // Throwaway databases, a temporary directory if empty
+	QString output; // JSON report, stdout if empty
+};
+
+// Fills a throwaway database with synthetic contacts, links and history and
+// times each Database method on it, once per table size
+class DbBench
+{
+private:
+	BenchOptions options_;
+	std::mt19937 random_;
+	int contacts_;
+
+public:
+	explicit DbBench(const BenchOptions &options);
+
+public:
+	bool run();
+
+private:
+	bool runSize(qint64 rows, const QString &fileName, QJsonObject &result);
+	bool fill(qint64 rows, QJsonObject &result);
+	QJsonObject measure(const std::function<void()> &call);
+	int randomContact();
+	static QString login(int id);
+};
+
+#endif // DBBENCH_H
@@ -0,0 +1,49 @@
+#include <QCoreApplication>
+#include <QCommandLineParser>
+
+#include "dbbench.h"
+#include "log.h"
+
+#include <iostream>
+
+int main(int argc, char *argv[])
+{
+	QCoreApplication a(argc, argv);
+	QCoreApplication::setApplicationName("maty_dbbench");
+
+	QCommandLineParser parser;
+	parser.setApplicationDescription("Database layer microbenchmark on synthetic data");
+	parser.addHelpOption();
+	parser.addOptions({
+		{ "sizes", "History rows of each run, comma separated.", "rows", "1000,10000,100000,1000000" },
+		{ "contacts-per-rows", "One contact per this many history rows.", "rows", "100" },
+		{ "links", "Linked contacts of every contact.", "count", "10" },
+		{ "iterations", "Calls of each method.", "count", "1000" },
+		{ "dir", "Directory of the throwaway databases.", "dir" },
+		{ "output", "JSON report file, stdout by default.", "file" }
+	});
+	parser.process(a);
+
+	BenchOptions options;
+	options.sizes.clear();
+	for (const QString &size : parser.value("sizes").split(',', Qt::SkipEmptyParts))
+	{
+		qint64 rows = size.trimmed().toLongLong();
+		if (rows <= 0)
+		{
+			std::cerr << "Invalid size: " << size.toStdString() << std::endl;
+			return 1;
+		}
+		options.sizes.push_back(rows);
+	}
+
+	options.contactsPerRows = qMax(parser.value("contacts-per-rows").toInt(), 1);
+	options.links = qMax(parser.value("links").toInt(), 0);
+	options.iterations = qMax(parser.value("iterations").toInt(), 1);
+	options.dir = parser.value("dir");
+	options.output = parser.value("output");
+
+	// Database code logs, to stderr so a report on stdout stays valid JSON
+	Log::create()->setConsole(std::cerr);
+	return DbBench(options).run() ? 0 : 1;
+}
@@ -0,0 +1,341 @@
+#include "loadgen.h"
+#include "dispatcher.h"
+#include "common.h"
+
+#include <QCoreApplication>
+#include <QCborValue>
+#include <QJsonArray>
+#include <QFile>
+#include <QFileInfo>
+#include <QTextStream>
+#include <QRandomGenerator>
+
+#include <iostream>
+
+namespace
+{
+
+const QString kPassword = "loadgen";
+const QString kTextPrefix = "lg ";
+
+}
+
+LoadClient::LoadClient(LoadGenerator *generator, int index)
+	: generator_(generator)
+	, index_(index)
+	, id_(0)
+	, hid_(0)
+	, connectStart_(0)
+{
+	connect(&socket_, &QWebSocket::connected, this, &LoadClient::connected);
+	connect(&socket_, &QWebSocket::textMessageReceived, this, &LoadClient::textMessageReceived);
+	connect(&socket_, &QWebSocket::binaryMessageReceived, this, &LoadClient::binaryMessageReceived);
+	connect(&timer_, &QTimer::timeout, this, &LoadClient::sendNext);
+}
+
+void LoadClient::connectToServer()
+{
+	connectStart_ = steady_micro();
+	socket_.open(generator_->options_.url);
+}
+
+void LoadClient::startTraffic()
+{
+	// Spread the first messages over one interval, so clients don't send in lockstep
+	int interval = qMax(static_cast<int>(1000.0 / generator_->options_.rate), 1);
+	QTimer::singleShot(QRandomGenerator::global()->bounded(interval), this, [this, interval]() {
+		timer_.start(interval);
+	});
+}
+
+void LoadClient::stopTraffic()
+{
+	timer_.stop();
+}
+
+void LoadClient::connected()
+{
+	QJsonObject object;
+	object["action"] = static_cast<int>(Dispatcher::Action::Registration);
+	object["name"] = login();
+	object["login"] = login();
+	object["password"] = kPassword;
+	object["phone"] = "";
+	send(object);
+}
+
+void LoadClient::textMessageReceived(const QString &message)
+{
+	process(message.toUtf8(), Protocol::Json);
+}
+
+void LoadClient::binaryMessageReceived(const QByteArray &message)
+{
+	// Compressed frame: a tagged byte string holding a message in our protocol
+	QCborValue value = QCborValue::fromCbor(message);
+	if (value.isTag())
+	{
+		if (value.tag() != QCborTag(kZlibFrameTag))
+		{
+			generator_->errors_.add();
+			return;
+		}
+
+		process(qUncompress(value.taggedValue().toByteArray()), generator_->options_.protocol);
+		return;
+	}
+
+	process(message, Protocol::Cbor);
+}
+
+void LoadClient::process(const QByteArray &data, Protocol protocol)
+{
+	QJsonObject object;
+	QString error;
+	if (!decodeMessage(data, protocol, object, error))
+	{
+		generator_->errors_.add();
+		return;
+	}
+
+	Dispatcher::Action action = static_cast<Dispatcher::Action>(object["action"].toInt());
+	int code = object["code"].toInt();
+
+	if (action == Dispatcher::Action::Registration)
+	{
+		if (code != static_cast<int>(Dispatcher::ErrorCode::Ok) &&
+			code != static_cast<int>(Dispatcher::ErrorCode::LoginExists))
+		{
+			generator_->errors_.add();
+			return;
+		}
+
+		QJsonObject auth;
+		auth["action"] = static_cast<int>(Dispatcher::Action::Auth);
+		auth["login"] = login();
+		auth["password"] = kPassword;
+		auth["protocol"] = static_cast<int>(generator_->options_.protocol);
+		if (generator_->options_.compression)
+			auth["compression"] = static_cast<int>(Compression::Zlib);
+		send(auth);
+	}
+	else if (action == Dispatcher::Action::Auth)
+	{
+		if (code != static_cast<int>(Dispatcher::ErrorCode::Ok))
+		{
+			generator_->errors_.add();
+			return;
+		}
+
+		id_ = object["id"].toInt();
+		generator_->auth_.record(steady_micro() - connectStart_);
+		generator_->clientReady();
+	}
+	else if (action == Dispatcher::Action::Message)
+	{
+		int64_t start = pendingAcks_.take(object["hid"].toInt());
+		if (code != static_cast<int>(Dispatcher::ErrorCode::Ok))
+			generator_->errors_.add();
+		else if (start > 0)
+			generator_->ack_.record(steady_micro() - start);
+	}
+	else if (action == Dispatcher::Action::NewHistory)
+	{
+		// Only count traffic of this run, auth may also return older history
+		int64_t now = steady_micro();
+		for (const QJsonValue &value : object["history"].toArray())
+		{
+			QString text = value.toObject()["text"].toString();
+			if (!text.startsWith(kTextPrefix))
+				continue;
+
+			int64_t sent = text.mid(kTextPrefix.size()).toLongLong();
+			if (sent < generator_->trafficStart_)
+				continue;
+
+			generator_->received_.add();
+			generator_->delivery_.record(now - sent);
+		}
+	}
+}
+
+void LoadClient::sendNext()
+{
+	int peer = generator_->randomPeer(index_);
+	if (peer == 0)
+		return;
+
+	bool message = QRandomGenerator::global()->bounded(100) < generator_->options_.messagePercent;
+	int64_t now = steady_micro();
+
+	QJsonObject object;
+	object["action"] = static_cast<int>(message ? Dispatcher::Action::Message : Dispatcher::Action::AddHistory);
+	object["hid"] = ++hid_;
+	object["cid"] = id_;
+	object["rid"] = peer;
+	object["text"] = kTextPrefix + QString::number(now);
+	if (message)
+		pendingAcks_[hid_] = now;
+
+	send(object);
+	generator_->sent_.add();
+}
+
+QString LoadClient::login() const
+{
+	return generator_->options_.prefix + QString::number(index_);
+}
+
+void LoadClient::send(const QJsonObject &object)
+{
+	sendFrame(&socket_, encodeMessage(object, generator_->options_.protocol), generator_->options_.protocol);
+}
+
+LoadGenerator::LoadGenerator(const LoadOptions &options)
+	: options_(options)
+	, ready_(0)
+	, trafficStart_(0)
+	, trafficEnd_(0)
+{
+	connectTimer_.setSingleShot(true);
+	connect(&connectTimer_, &QTimer::timeout, this, &LoadGenerator::connectTimeout);
+	stopTimer_.setSingleShot(true);
+	connect(&stopTimer_, &QTimer::timeout, this, &LoadGenerator::finish);
+}
+
+LoadGenerator::~LoadGenerator()
+{
+	qDeleteAll(clients_);
+}
+
+void LoadGenerator::start()
+{
+	std::cout << "Connecting " << options_.clients << " clients to " << options_.url.toString().toStdString() << std::endl;
+	for (int i = 0; i < options_.clients; ++i)
+	{
+		LoadClient *client = new LoadClient(this, i);
+		clients_.push_back(client);
+		client->connectToServer();
+	}
+
+	connectTimer_.start(options_.connectTimeout * 1000);
+}
+
+void LoadGenerator::clientReady()
+{
+	// A client authorized after the timeout stays idle
+	if (++ready_ == clients_.size() && trafficStart_ == 0)
+	{
+		std::cout << "All clients authorized, sending for " << options_.duration << " s" << std::endl;
+		startTraffic();
+	}
+}
+
+void LoadGenerator::connectTimeout()
+{
+	// Failed connects, registrations and auths would otherwise wait forever
+	int failed = clients_.size() - ready_;
+	std::cerr << failed << " of " << clients_.size() << " clients not authorized in "
+			  << options_.connectTimeout << " s" << std::endl;
+	errors_.add(static_cast<uint64_t>(failed));
+
+	if (ready_ < 2)
+	{
+		QCoreApplication::exit(1);
+		return;
+	}
+
+	std::cout << ready_ << " clients authorized, sending for " << options_.duration << " s" << std::endl;
+	startTraffic();
+}
+
+void LoadGenerator::startTraffic()
+{
+	connectTimer_.stop();
+	trafficStart_ = steady_micro();
+	for (LoadClient *client : clients_)
+	{
+		if (client->id() != 0)
+			client->startTraffic();
+	}
+	stopTimer_.start(options_.duration * 1000);
+}
+
+void LoadGenerator::finish()
+{
+	for (LoadClient *client : clients_)
+		client->stopTraffic();
+	trafficEnd_ = steady_micro();
+
+	// Give messages in flight time to arrive
+	QTimer::singleShot(2000, this, [this]() {
+		report();
+		if (!options_.csv.isEmpty())
+			writeCsv();
+		QCoreApplication::exit(errors_.value() > 0 ? 1 : 0);
+	});
+}
+
+int LoadGenerator::randomPeer(int index) const
+{
+	if (clients_.size() < 2)
+		return 0;
+
+	int peer = QRandomGenerator::global()->bounded(clients_.size() - 1);
+	if (peer >= index)
+		++peer;
+	return clients_[peer]->id();
+}
+
+void LoadGenerator::report() const
+{
+	double seconds = (trafficEnd_ - trafficStart_) / 1e6;
+	std::cout << "Sent: " << sent_.value() << ", received: " << received_.value()
+			  << ", errors: " << errors_.value() << std::endl;
+	std::cout << "Throughput: " << (seconds > 0 ? sent_.value() / seconds : 0) << " msg/s" << std::endl;
+
+	auto print = [](const char *name, const Histogram &histogram) {
+		std::cout << name << " us: count " << histogram.count()
+				  << ", p50 " << histogram.percentile(50.0)
+				  << ", p90 " << histogram.percentile(90.0)
+				  << ", p99 " << histogram.percentile(99.0)
+				  << ", p999 " << histogram.percentile(99.9)
+				  << ", max " << histogram.max() << std::endl;
+	};
+
+	print("Delivery", delivery_);
+	print("Ack", ack_);
+	print("Auth", auth_);
+}
+
+void LoadGenerator::writeCsv() const
+{
+	// One row per metric and run, appended so runs can be compared
+	QFile file(options_.csv);
+	bool header = !QFileInfo::exists(options_.csv) || QFileInfo(options_.csv).size() == 0;
+	if (!file.open(QIODevice::WriteOnly | QIODevice::Append | QIODevice::Text))
+	{
+		std::cerr << "Can't write " << options_.csv.toStdString() << std::endl;
+		return;
+	}
+
+	QTextStream stream(&file);
+	if (header)
+		stream << "clients,rate,message_percent,protocol,compression,duration_s,sent,received,errors,"
+				  "throughput,metric,count,p50_us,p90_us,p99_us,p999_us,max_us\n";
+
+	double seconds = (trafficEnd_ - trafficStart_) / 1e6;
+	auto row = [&](const char *name, const Histogram &histogram) {
+		stream << options_.clients << ',' << options_.rate << ',' << options_.messagePercent << ','
+			   << (options_.protocol == Protocol::Cbor ? "cbor" : "json") << ',' << options_.compression << ','
+			   << seconds << ',' << sent_.value() << ',' << received_.value() << ',' << errors_.value() << ','
+			   << (seconds > 0 ? sent_.value() / seconds : 0) << ',' << name << ',' << histogram.count() << ','
+			   << histogram.percentile(50.0) << ',' << histogram.percentile(90.0) << ','
+			   << histogram.percentile(99.0) << ',' << histogram.percentile(99.9) << ','
+			   << histogram.max() << '\n';
+	};
+
+	row("delivery", delivery_);
+	row("ack", ack_);
+	row("auth", auth_);
+}
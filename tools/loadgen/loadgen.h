@@ -0,0 +1,108 @@
+#ifndef LOADGEN_H
+#define LOADGEN_H
+
+#include <QObject>
+#include <QWebSocket>
+#include <QTimer>
+#include <QUrl>
+#include <QList>
+#include <QHash>
+#include <QJsonObject>
+
+#include "protocol.h"
+#include "metrics.h"
+
+// Run parameters, set from the command line
+struct LoadOptions
+{
+	QUrl url;
+	int clients = 100;
+	int duration = 30; // Seconds of traffic after every client has authorized
+	int connectTimeout = 30; // Seconds to authorize, traffic starts with the clients ready by then
+	double rate = 1.0; // Messages per second of one client
+	int messagePercent = 80; // Message actions, the rest is AddHistory
+	Protocol protocol = Protocol::Json;
+	bool compression = false;
+	QString prefix = "loadgen";
+	QString csv;
+};
+
+class LoadGenerator;
+
+// One simulated user: registers, authorizes, then sends traffic to random peers
+class LoadClient : public QObject
+{
+	Q_OBJECT
+
+private:
+	LoadGenerator *generator_;
+	int index_;
+	int id_;
+	int hid_;
+	int64_t connectStart_;
+	QWebSocket socket_;
+	QTimer timer_;
+	QHash<int, int64_t> pendingAcks_; // Message hid -> send time
+
+public:
+	LoadClient(LoadGenerator *generator, int index);
+
+public:
+	void connectToServer();
+	void startTraffic();
+	void stopTraffic();
+	int id() const { return id_; }
+
+private slots:
+	void connected();
+	void textMessageReceived(const QString &message);
+	void binaryMessageReceived(const QByteArray &message);
+	void sendNext();
+
+private:
+	QString login() const;
+	void send(const QJsonObject &object);
+	void process(const QByteArray &data, Protocol protocol);
+};
+
+// Drives the clients and collects the results
+class LoadGenerator : public QObject
+{
+	Q_OBJECT
+
+	friend class LoadClient;
+
+private:
+	LoadOptions options_;
+	QList<LoadClient *> clients_;
+	int ready_;
+	int64_t trafficStart_;
+	int64_t trafficEnd_;
+	QTimer connectTimer_;
+	QTimer stopTimer_;
+
+	Histogram delivery_; // Sender to recipient socket
+	Histogram ack_; // Message to its durable ack
+	Histogram auth_; // Connect to auth reply
+	Counter sent_;
+	Counter received_;
+	Counter errors_;
+
+public:
+	explicit LoadGenerator(const LoadOptions &options);
+	~LoadGenerator();
+
+public:
+	void start();
+
+private:
+	void clientReady();
+	void connectTimeout();
+	void startTraffic();
+	void finish();
+	int randomPeer(int index) const;
+	void report() const;
+	void writeCsv() const;
+};
+
+#endif // LOADGEN_H
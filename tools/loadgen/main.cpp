@@ -0,0 +1,43 @@
+#include <QCoreApplication>
+#include <QCommandLineParser>
+
+#include "loadgen.h"
+
+int main(int argc, char *argv[])
+{
+	QCoreApplication a(argc, argv);
+	QCoreApplication::setApplicationName("maty_loadgen");
+
+	QCommandLineParser parser;
+	parser.setApplicationDescription("Simulated clients against a running maty_server");
+	parser.addHelpOption();
+	parser.addOptions({
+		{ "url", "Server address.", "url", "ws://127.0.0.1:1978" },
+		{ "clients", "Simulated clients.", "count", "100" },
+		{ "duration", "Traffic time, seconds.", "seconds", "30" },
+		{ "connect-timeout", "Time for the clients to authorize, seconds.", "seconds", "30" },
+		{ "rate", "Messages per second of one client.", "rate", "1" },
+		{ "message-percent", "Share of Message actions, the rest is AddHistory.", "percent", "80" },
+		{ "cbor", "Send CBOR binary frames." },
+		{ "compression", "Ask for zlib compressed frames." },
+		{ "prefix", "Login prefix of the simulated users.", "prefix", "loadgen" },
+		{ "csv", "Append the results to a CSV file.", "file" }
+	});
+	parser.process(a);
+
+	LoadOptions options;
+	options.url = QUrl(parser.value("url"));
+	options.clients = qMax(parser.value("clients").toInt(), 1);
+	options.duration = qMax(parser.value("duration").toInt(), 1);
+	options.connectTimeout = qMax(parser.value("connect-timeout").toInt(), 1);
+	options.rate = qMax(parser.value("rate").toDouble(), 0.001);
+	options.messagePercent = qBound(0, parser.value("message-percent").toInt(), 100);
+	options.protocol = parser.isSet("cbor") ? Protocol::Cbor : Protocol::Json;
+	options.compression = parser.isSet("compression");
+	options.prefix = parser.value("prefix");
+	options.csv = parser.value("csv");
+
+	LoadGenerator generator(options);
+	generator.start();
+	return a.exec();
+}